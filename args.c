@@ -4,71 +4,121 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
 
 
 #include "includes/functions.h"
 #include "includes/args.h"
+#include "includes/buffer.h"
 
-/**
- * Struct of command line arguments
-**/
-
+#define USAGE "usage: nbd-server -p [port] [-w workers] [-b sync|uring|uring-reg] [-z] [-q depth] [-m pool-MB] -d [[file] [name]...]\n"
 
 /**
  * Function that check argv line
- *	 1st arg - binded port
- *	 2nd arg - path to shared file
+ *	 -p - binded port
+ *	 -w - number of epoll workers (0 - fork per client)
+ *	 -b - storage backend (sync, uring, uring-reg)
+ *	 -z - zero-copy READ replies (sendfile)
+ *	 -q - max transmission requests in flight per client
+ *	 -m - memory of request buffers pool (MB)
+ *	 -d - (path to shared file, exportname) pairs until the end of line
 **/
 CMD_ARGS*
 valid_cmdline(int argc, char* argv[])
 {
-	if (argc > 4)
+	CMD_ARGS* ca = (CMD_ARGS*) malloc(sizeof(CMD_ARGS));
+	if (ca == NULL)
 	{
-		if (strcmp(argv[1], "-p") || strcmp(argv[3], "-d"))
-		{	
-			INFO("usage: nbd-server -p [port] -d [[file]...]\n");
-			return NULL;
-		}
-
-		CMD_ARGS* ca = (CMD_ARGS*) malloc(sizeof(CMD_ARGS));
-		if (ca == NULL)
-		{
-			ERROR("malloc error");
-			exit(EXIT_FAILURE);
-		}
-
-		uint32_t port = atoi(argv[2]);  // port
-		if (port >= 65536) 
+		ERROR("malloc error");
+		exit(EXIT_FAILURE);
+	}
+	ca->port = 0;
+	ca->workers = 0;
+	ca->backend = "sync";
+	ca->zerocopy = 0;
+	ca->depth = 1;
+	ca->pool = BUFFER_DEFAULT_CAP >> 20;
+	ca->lf_path_name = NULL;
+	ca->n = 0;
+
+	int opt, file_numb = -1;
+	while (file_numb == -1 && (opt = getopt(argc, argv, "+p:w:b:zq:m:d")) != -1)
+	{
+		switch (opt)
 		{
-			ERROR("invalid port");
-			free(ca);
-			return NULL;
+			case 'p':
+			{
+				uint32_t port = atoi(optarg);  // port
+				if (port == 0 || port >= 65536) 
+				{
+					ERROR("invalid port\n");
+					free(ca);
+					return NULL;
+				}
+				ca->port = port;
+				break;
+			}
+			case 'w':
+				ca->workers = atoi(optarg);
+				break;
+			case 'b':
+				ca->backend = optarg;
+				break;
+			case 'z':
+				ca->zerocopy = 1;
+				break;
+			case 'q':
+				ca->depth = atoi(optarg);
+				if (ca->depth == 0)
+				{
+					ERROR("invalid queue depth\n");
+					free(ca);
+					return NULL;
+				}
+				break;
+			case 'm':
+				ca->pool = atoi(optarg);
+				if (ca->pool == 0)
+				{
+					ERROR("invalid pool size\n");
+					free(ca);
+					return NULL;
+				}
+				break;
+			case 'd':
+				ca->lf_path_name = argv + optind; 	// array with device:name
+				file_numb = argc - optind;
+				break;
+			default:
+				INFO(USAGE);
+				free(ca);
+				return NULL;
 		}
-		ca->port = port;
-		ca->lf_path_name = argv + 4; 	// array with device:name
-			
+	}
+	if (ca->port == 0 || file_numb <= 0)
+	{
+		INFO(USAGE);
+		free(ca);
+		return NULL;
+	}
 
-		int file_numb = argc - 4;
-		if (file_numb % 2 != 0)
+	if (file_numb % 2 != 0)
+	{
+		INFO("Invalid number of shared devices\n");
+		free(ca);
+		return NULL;
+	}
+	for (int i = 0; i < file_numb; i++)
+	{
+		if (i % 2 == 0 && access(ca->lf_path_name[i], F_OK))
 		{
-			INFO("Invalid number of shared devices\n");
+			ERROR("failed to access file");
 			free(ca);
 			return NULL;
 		}
-		for (int i = 0; i < file_numb; i++)
-		{
-			if (i % 2 == 0 && access(ca->lf_path_name[i], F_OK))
-			{
-				ERROR("failed to access file");
-				free(ca);
-				return NULL;
-			}
-		}
-		ca->n = file_numb / 2;
-		return ca;
 	}
-	INFO("usage: nbd-server -p [port] -d [[file] [name]...]\n");
-	return NULL;
+	ca->n = file_numb / 2;
+	return ca;
 }
 
 /*
@@ -99,17 +149,37 @@ parse_devices_line(CMD_ARGS* ca)
 			exit(EXIT_FAILURE);
 		}
 
-		r[i]->fd = open(ca->lf_path_name[2 * i], O_RDONLY);
-		if (r[i]->fd == -1)
+		// writable if we may, otherwise export is read-only
+		r[i]->readonly = 0;
+		int fd = open(ca->lf_path_name[2 * i], O_RDWR);
+		if (fd == -1 && (errno == EACCES || errno == EROFS || errno == EPERM))
+		{
+			r[i]->readonly = 1;
+			fd = open(ca->lf_path_name[2 * i], O_RDONLY);
+		}
+		if (fd == -1)
 		{
 			ERROR("Failed to open file");
+			free(r[i]);
+			free_resources_cmd_line(r, i);
+			free(ca);
+			exit(EXIT_FAILURE);
+		}
+		r[i]->fd = fd;
+
+		r[i]->state = export_state_create();
+		if (r[i]->state == NULL)
+		{
+			ERROR("Failed to create export's sync state");
+			close(fd);
+			free(r[i]);
 			free_resources_cmd_line(r, i);
 			free(ca);
 			exit(EXIT_FAILURE);
 		}
 		r[i]->exportname = ca->lf_path_name[2 * i + 1];
 
-		r[i]->size = get_file_size(r[i]->fd);
+		r[i]->size = get_file_size(r[i]->fd, &r[i]->blockdev);
 		if (r[i]->size == -1)
 		{
 			ERROR("Failed to stat file");
@@ -120,7 +190,8 @@ parse_devices_line(CMD_ARGS* ca)
 
 		fprintf(stderr, "Name = %s\n", r[i]->exportname);
 		fprintf(stderr, "Path = %s\n", ca->lf_path_name[2 * i]);
-		fprintf(stderr, "File size = %ld\n-------------\n", r[i]->size);
+		fprintf(stderr, "File size = %ld\n", r[i]->size);
+		fprintf(stderr, "Mode = %s\n-------------\n", r[i]->readonly ? "read-only" : "read-write");
 	}
 	return r;
 }
@@ -134,6 +205,7 @@ free_resources_cmd_line(RESOURCE** r, int n)
 	for (int i = 0; i < n; i++)
 	{
 		close(r[i]->fd);
+		export_state_destroy(r[i]->state);
 		free(r[i]);
 	}
 	free(r);
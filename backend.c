@@ -0,0 +1,494 @@
+/**
+ * backend.c
+ * Storage backends for transmission commands.
+ * io_uring is used through raw syscalls, every thread owns its ring
+ * (created on first I/O), so the same code works for epoll workers
+ * and forked clients. When io_uring can't be set up, sync path is used
+**/
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "includes/functions.h"
+#include "includes/backend.h"
+
+#define BACKEND_MAX_BUFFERS	64
+
+/*
+ * io_uring instance (mapped SQ/CQ rings)
+*/
+typedef struct
+{
+	int						fd;
+	unsigned*				sq_head;
+	unsigned*				sq_tail;
+	unsigned*				sq_mask;
+	unsigned*				sq_array;
+	unsigned*				cq_head;
+	unsigned*				cq_tail;
+	unsigned*				cq_mask;
+	struct io_uring_sqe*	sqes;
+	struct io_uring_cqe*	cqes;
+	unsigned				entries;
+	void*					ring_ptr;
+	size_t					ring_sz;
+	size_t					sqes_sz;
+	int						buffers;	// registered buffers generation
+} URING;
+
+static int backend = BACKEND_SYNC;
+
+// uring-reg : export's fds -> index in registered files table
+static int* fixed_files = NULL;
+static int	fixed_nfiles = 0;
+static int* fixed_index = NULL;
+static int	fixed_max_fd = -1;
+
+// uring-reg : registered buffers
+static struct iovec fixed_bufs[BACKEND_MAX_BUFFERS];
+static int			fixed_nbufs = 0;
+
+static __thread URING*	ring = NULL;
+static __thread int		ring_failed = 0;
+
+
+static void
+uring_free(URING* r)
+{
+	if (r->sqes != NULL && r->sqes != MAP_FAILED)
+		munmap(r->sqes, r->sqes_sz);
+	if (r->ring_ptr != NULL && r->ring_ptr != MAP_FAILED)
+		munmap(r->ring_ptr, r->ring_sz);
+	close(r->fd);
+	free(r);
+}
+
+/*
+ * (re)register fixed buffers when new ones appeared after ring creation
+*/
+static void
+uring_sync_buffers(URING* r)
+{
+	int n = __atomic_load_n(&fixed_nbufs, __ATOMIC_ACQUIRE);
+	if (r->buffers == n)
+		return;
+	if (r->buffers)
+		syscall(__NR_io_uring_register, r->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, fixed_bufs, n) == 0)
+		r->buffers = n;
+	else
+		r->buffers = 0;
+}
+
+/*
+ * create io_uring instance
+ * returns NULL if io_uring is not available
+*/
+static URING*
+uring_setup(void)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = syscall(__NR_io_uring_setup, BACKEND_QUEUE_DEPTH, &p);
+	if (fd < 0)
+		return NULL;
+
+	URING* r = (URING*) calloc(1, sizeof(URING));
+	if (r == NULL)
+	{
+		close(fd);
+		return NULL;
+	}
+	r->fd = fd;
+	// SQ and CQ rings share one mapping (kernels >= 5.4)
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+	{
+		uring_free(r);
+		return NULL;
+	}
+	size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->ring_sz = sq_sz > cq_sz ? sq_sz : cq_sz;
+	r->ring_ptr = mmap(NULL, r->ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (r->ring_ptr == MAP_FAILED || r->sqes == MAP_FAILED)
+	{
+		uring_free(r);
+		return NULL;
+	}
+	char* base = r->ring_ptr;
+	r->sq_head	= (unsigned*) (base + p.sq_off.head);
+	r->sq_tail	= (unsigned*) (base + p.sq_off.tail);
+	r->sq_mask	= (unsigned*) (base + p.sq_off.ring_mask);
+	r->sq_array	= (unsigned*) (base + p.sq_off.array);
+	r->cq_head	= (unsigned*) (base + p.cq_off.head);
+	r->cq_tail	= (unsigned*) (base + p.cq_off.tail);
+	r->cq_mask	= (unsigned*) (base + p.cq_off.ring_mask);
+	r->cqes		= (struct io_uring_cqe*) (base + p.cq_off.cqes);
+	r->entries	= p.sq_entries;
+
+	if (backend == BACKEND_URING_REG && fixed_nfiles > 0)
+	{
+		if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES, fixed_files, fixed_nfiles))
+		{
+			ERROR("io_uring: failed to register files\n");
+			uring_free(r);
+			return NULL;
+		}
+	}
+	return r;
+}
+
+/*
+ * ring of the calling thread (NULL -> use sync path)
+*/
+static URING*
+uring_get(void)
+{
+	if (ring == NULL && !ring_failed)
+	{
+		ring = uring_setup();
+		if (ring == NULL)
+		{
+			ERROR("io_uring is not available in this thread, sync backend is used\n");
+			ring_failed = 1;
+		}
+	}
+	if (ring != NULL && backend == BACKEND_URING_REG)
+		uring_sync_buffers(ring);
+	return ring;
+}
+
+/*
+ * index of registered buffer containing [buf, buf + len) or -1
+*/
+static int
+fixed_buffer(URING* r, void* buf, uint32_t len)
+{
+	char* p = buf;
+	for (int i = 0; i < r->buffers; i++)
+	{
+		char* b = fixed_bufs[i].iov_base;
+		if (p >= b && p + len <= b + fixed_bufs[i].iov_len)
+			return i;
+	}
+	return -1;
+}
+
+static void
+uring_prep(URING* r, struct io_uring_sqe* sqe, BACKEND_IO* io, uint64_t idx)
+{
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = io->op == BACKEND_READ ? IORING_OP_READ : IORING_OP_WRITE;
+	sqe->fd = io->fd;
+	sqe->addr = (uint64_t) (uintptr_t) io->buf;
+	sqe->len = io->len;
+	sqe->off = io->offset;
+	sqe->user_data = idx;
+	if (backend != BACKEND_URING_REG)
+		return;
+	if (io->fd <= fixed_max_fd && fixed_index[io->fd] != -1)
+	{
+		sqe->fd = fixed_index[io->fd];
+		sqe->flags |= IOSQE_FIXED_FILE;
+	}
+	int b = fixed_buffer(r, io->buf, io->len);
+	if (b != -1)
+	{
+		sqe->opcode = io->op == BACKEND_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+		sqe->buf_index = b;
+	}
+}
+
+/*
+ * submit whole batch, keeping at most ring->entries I/Os in flight,
+ * and reap completions
+*/
+static int
+uring_submit(URING* r, BACKEND_IO* io, int n)
+{
+	int next = 0, inflight = 0, done = 0;
+	while (done < n)
+	{
+		unsigned tail = *r->sq_tail;
+		while (next < n && inflight < r->entries)
+		{
+			unsigned idx = tail & *r->sq_mask;
+			uring_prep(r, &r->sqes[idx], &io[next], next);
+			r->sq_array[idx] = idx;
+			tail++;
+			next++;
+			inflight++;
+		}
+		__atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+		unsigned to_submit = tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+		if (syscall(__NR_io_uring_enter, r->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+				&& errno != EINTR)
+		{
+			ERROR("io_uring_enter lcall error\n");
+			return -1;
+		}
+
+		unsigned head = *r->cq_head;
+		while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		{
+			struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+			io[cqe->user_data].res = cqe->res;
+			head++;
+			inflight--;
+			done++;
+		}
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+/*
+ * blocking I/O of the rest of io (from io->res bytes)
+*/
+static void
+sync_complete(BACKEND_IO* io)
+{
+	uint64_t acc = io->res > 0 ? io->res : 0;
+	char* p = io->buf;
+	while (acc < io->len)
+	{
+		ssize_t cnt = io->op == BACKEND_READ
+			? pread(io->fd, p + acc, io->len - acc, io->offset + acc)
+			: pwrite(io->fd, p + acc, io->len - acc, io->offset + acc);
+		if (cnt == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			io->res = -errno;
+			return;
+		}
+		if (cnt == 0)
+			break;	// end of file
+		acc += cnt;
+	}
+	io->res = acc;
+}
+
+
+int
+backend_select(const char* name)
+{
+	if (!strcmp(name, "sync"))
+		backend = BACKEND_SYNC;
+	else if (!strcmp(name, "uring"))
+		backend = BACKEND_URING;
+	else if (!strcmp(name, "uring-reg"))
+		backend = BACKEND_URING_REG;
+	else
+		return -1;
+
+	if (backend != BACKEND_SYNC)
+	{
+		// probe : rings themselves are created by each thread on demand
+		URING* r = uring_setup();
+		if (r == NULL)
+		{
+			INFO("... io_uring is not available, fallback to sync backend ...\n");
+			backend = BACKEND_SYNC;
+		}
+		else
+		{
+			uring_free(r);
+		}
+	}
+	return backend;
+}
+
+void
+backend_register_files(int* fds, int n)
+{
+	int max_fd = -1;
+	for (int i = 0; i < n; i++)
+		if (fds[i] > max_fd)
+			max_fd = fds[i];
+	fixed_files = (int*) malloc(sizeof(int) * n);
+	fixed_index = (int*) malloc(sizeof(int) * (max_fd + 1));
+	if (fixed_files == NULL || fixed_index == NULL)
+	{
+		ERROR("malloc error\n");
+		exit(EXIT_FAILURE);
+	}
+	memset(fixed_index, -1, sizeof(int) * (max_fd + 1));
+	for (int i = 0; i < n; i++)
+	{
+		fixed_files[i] = fds[i];
+		fixed_index[fds[i]] = i;
+	}
+	fixed_nfiles = n;
+	fixed_max_fd = max_fd;
+}
+
+int
+backend_register_buffer(void* base, size_t len)
+{
+	if (fixed_nbufs == BACKEND_MAX_BUFFERS)
+		return -1;
+	fixed_bufs[fixed_nbufs].iov_base = base;
+	fixed_bufs[fixed_nbufs].iov_len = len;
+	__atomic_store_n(&fixed_nbufs, fixed_nbufs + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int
+backend_submit(BACKEND_IO* io, int n)
+{
+	URING* r = backend == BACKEND_SYNC ? NULL : uring_get();
+	if (r != NULL)
+	{
+		for (int i = 0; i < n; i++)
+			io[i].res = -EIO;
+		if (uring_submit(r, io, n))
+		{
+			// ring is broken : don't use it in this thread anymore
+			uring_free(r);
+			ring = NULL;
+			ring_failed = 1;
+		}
+	}
+	else
+	{
+		for (int i = 0; i < n; i++)
+			io[i].res = 0;
+	}
+
+	// short transfers (or unsupported opcodes on old kernels) are completed synchronously
+	int rc = 0;
+	for (int i = 0; i < n; i++)
+	{
+		if (io[i].res < (int64_t) io[i].len)
+			sync_complete(&io[i]);
+		if (io[i].res < 0)
+			rc = -1;
+	}
+	return rc;
+}
+
+/*
+ * split request to chunks and execute them as batches
+*/
+static ssize_t
+backend_rw(int op, int fd, void* buf, uint32_t len, uint64_t offset)
+{
+	BACKEND_IO io[BACKEND_QUEUE_DEPTH];
+	uint32_t chunk = backend == BACKEND_SYNC ? len : BACKEND_CHUNK;
+	uint32_t acc = 0;
+	char* p = buf;
+
+	while (acc < len)
+	{
+		int n = 0;
+		uint32_t batch = 0;
+		while (n < BACKEND_QUEUE_DEPTH && acc + batch < len)
+		{
+			uint32_t l = len - acc - batch < chunk ? len - acc - batch : chunk;
+			io[n].op = op;
+			io[n].fd = fd;
+			io[n].buf = p + acc + batch;
+			io[n].len = l;
+			io[n].offset = offset + acc + batch;
+			batch += l;
+			n++;
+		}
+		if (backend_submit(io, n))
+			return -1;
+		for (int i = 0; i < n; i++)
+		{
+			acc += io[i].res;
+			if (io[i].res < io[i].len)
+				return acc;	// end of file
+		}
+	}
+	return acc;
+}
+
+ssize_t
+backend_read(int fd, void* buf, uint32_t len, uint64_t offset)
+{
+	return backend_rw(BACKEND_READ, fd, buf, len, offset);
+}
+
+ssize_t
+backend_write(int fd, void* buf, uint32_t len, uint64_t offset)
+{
+	return backend_rw(BACKEND_WRITE, fd, buf, len, offset);
+}
+
+int
+backend_discard(int fd, int blockdev, uint64_t offset, uint64_t len)
+{
+	int rc;
+	if (blockdev)
+	{
+		uint64_t range[2] = { offset, len };
+		rc = ioctl(fd, BLKDISCARD, &range);
+	}
+	else
+		rc = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+	if (rc == -1 && (errno == EOPNOTSUPP || errno == ENOTTY))
+		return 0;
+	return rc;
+}
+
+/*
+ * fallback of backend_zero : write zeroes chunk by chunk
+*/
+static int
+backend_zero_write(int fd, uint64_t offset, uint64_t len)
+{
+	char* zero = (char*) calloc(1, BACKEND_CHUNK);
+	if (zero == NULL)
+		return -1;
+	int rc = 0;
+	while (len > 0 && rc == 0)
+	{
+		uint32_t l = len < BACKEND_CHUNK ? len : BACKEND_CHUNK;
+		if (backend_write(fd, zero, l, offset) != l)
+			rc = -1;
+		offset += l;
+		len -= l;
+	}
+	free(zero);
+	return rc;
+}
+
+int
+backend_zero(int fd, int blockdev, uint64_t offset, uint64_t len, int no_hole)
+{
+	if (blockdev)
+	{
+		// device decides itself if zeroed blocks are unmapped
+		uint64_t range[2] = { offset, len };
+		if (ioctl(fd, BLKZEROOUT, &range) == 0)
+			return 0;
+	}
+	else
+	{
+		if (!no_hole && fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0)
+			return 0;
+		if (fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, len) == 0)
+			return 0;
+	}
+	if (errno != EOPNOTSUPP && errno != ENOTTY && errno != EINVAL)
+		return -1;
+	return backend_zero_write(fd, offset, len);
+}
@@ -0,0 +1,172 @@
+/**
+ * buffer.c
+ * Pooled aligned buffers : arena -> slabs -> size classes -> thread caches
+**/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "includes/functions.h"
+#include "includes/backend.h"
+#include "includes/buffer.h"
+
+#define BUFFER_PAGE			4096
+// registered buffer of io_uring can't be larger
+#define BUFFER_REGISTER_MAX	(1UL << 30)
+
+/*
+ * free buffer (list is linked through buffers themselves)
+*/
+typedef struct BUFFER_FREE
+{
+	struct BUFFER_FREE*	next;
+} BUFFER_FREE;
+
+typedef struct
+{
+	BUFFER_FREE*	head;
+	int				n;
+} BUFFER_CACHE;
+
+static pthread_mutex_t	pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static char*			arena = NULL;
+static size_t			arena_size = 0;
+static size_t			arena_used = 0;
+static BUFFER_FREE*		pool_free[BUFFER_CLASSES];
+
+static __thread BUFFER_CACHE	cache[BUFFER_CLASSES];
+
+
+/*
+ * size class of len bytes (BUFFER_CLASSES - too large for the pool)
+*/
+static int
+buffer_class(size_t len)
+{
+	int c = 0;
+	while (c < BUFFER_CLASSES && ((size_t) 1 << (c + BUFFER_MIN_SHIFT)) < len)
+		c++;
+	return c;
+}
+
+/*
+ * take len bytes of arena (never crossing registered area's border)
+ * must be called under pool lock
+*/
+static char*
+arena_take(size_t len)
+{
+	size_t start = arena_used;
+	if (start / BUFFER_REGISTER_MAX != (start + len - 1) / BUFFER_REGISTER_MAX)
+		start = (start + len - 1) / BUFFER_REGISTER_MAX * BUFFER_REGISTER_MAX;
+	if (start + len > arena_size)
+		return NULL;
+	arena_used = start + len;
+	return arena + start;
+}
+
+/*
+ * new buffers of class c from arena (small classes get a whole slab)
+ * must be called under pool lock
+*/
+static void
+buffer_refill(int c)
+{
+	size_t size = (size_t) 1 << (c + BUFFER_MIN_SHIFT);
+	size_t slab = size < ((size_t) 1 << BUFFER_SLAB_SHIFT) ? (size_t) 1 << BUFFER_SLAB_SHIFT : size;
+	char* p = arena_take(slab);
+	if (p == NULL && slab != size)
+	{
+		slab = size;
+		p = arena_take(slab);
+	}
+	if (p == NULL)
+		return;
+	for (size_t off = 0; off < slab; off += size)
+	{
+		BUFFER_FREE* b = (BUFFER_FREE*) (p + off);
+		b->next = pool_free[c];
+		pool_free[c] = b;
+	}
+}
+
+int
+buffer_pool_init(size_t cap)
+{
+	if (cap < ((size_t) 1 << BUFFER_MAX_SHIFT))
+		cap = (size_t) 1 << BUFFER_MAX_SHIFT;
+	cap = (cap + BUFFER_PAGE - 1) / BUFFER_PAGE * BUFFER_PAGE;
+	// pages are taken from the system when buffers are used first
+	void* p = mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED)
+		return -1;
+	arena = p;
+	arena_size = cap;
+	for (size_t off = 0; off < cap; off += BUFFER_REGISTER_MAX)
+	{
+		size_t len = cap - off < BUFFER_REGISTER_MAX ? cap - off : BUFFER_REGISTER_MAX;
+		if (backend_register_buffer(arena + off, len))
+			break;
+	}
+	return 0;
+}
+
+void*
+buffer_get(size_t len)
+{
+	int c = buffer_class(len);
+	if (c < BUFFER_CLASSES)
+	{
+		BUFFER_CACHE* tc = &cache[c];
+		if (tc->head != NULL)
+		{
+			BUFFER_FREE* b = tc->head;
+			tc->head = b->next;
+			tc->n--;
+			return b;
+		}
+		pthread_mutex_lock(&pool_lock);
+		if (pool_free[c] == NULL)
+			buffer_refill(c);
+		BUFFER_FREE* b = pool_free[c];
+		if (b != NULL)
+			pool_free[c] = b->next;
+		pthread_mutex_unlock(&pool_lock);
+		if (b != NULL)
+			return b;
+	}
+	// pool is exhausted (or request is too large) : buffer lives until put
+	void* buf;
+	if (posix_memalign(&buf, BUFFER_PAGE, len ? len : 1))
+		return NULL;
+	return buf;
+}
+
+void
+buffer_put(void* buf, size_t len)
+{
+	if (buf == NULL)
+		return;
+	char* p = buf;
+	if (p < arena || p >= arena + arena_size)
+	{
+		free(buf);
+		return;
+	}
+	int c = buffer_class(len);
+	BUFFER_FREE* b = buf;
+	BUFFER_CACHE* tc = &cache[c];
+	if (c + BUFFER_MIN_SHIFT <= BUFFER_SLAB_SHIFT && tc->n < BUFFER_THREAD_CACHE)
+	{
+		b->next = tc->head;
+		tc->head = b;
+		tc->n++;
+		return;
+	}
+	pthread_mutex_lock(&pool_lock);
+	b->next = pool_free[c];
+	pool_free[c] = b;
+	pthread_mutex_unlock(&pool_lock);
+}
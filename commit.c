@@ -0,0 +1,111 @@
+/**
+ * commit.c
+ * Group commit: every durability request takes a ticket. The first one
+ * without running sync becomes a leader, its fdatasync covers all tickets
+ * given before it started; others just wait for the covering sync.
+ * Write generation lets flush return at once when nothing was written
+ * (by any client) since the last successful sync had started
+**/
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "includes/functions.h"
+#include "includes/commit.h"
+
+
+/*
+ * lock shared state (client process could die holding the lock)
+*/
+static void
+group_commit_lock(GROUP_COMMIT* gc)
+{
+	if (pthread_mutex_lock(&gc->lock) == EOWNERDEAD)
+	{
+		// its sync is lost : next waiter leads a new one
+		gc->syncing = 0;
+		pthread_mutex_consistent(&gc->lock);
+	}
+}
+
+void
+group_commit_init(GROUP_COMMIT* gc)
+{
+	pthread_mutexattr_t ma;
+	pthread_mutexattr_init(&ma);
+	pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&gc->lock, &ma);
+	pthread_mutexattr_destroy(&ma);
+
+	pthread_condattr_t ca;
+	pthread_condattr_init(&ca);
+	pthread_condattr_setpshared(&ca, PTHREAD_PROCESS_SHARED);
+	pthread_cond_init(&gc->cond, &ca);
+	pthread_condattr_destroy(&ca);
+
+	gc->requested = 0;
+	gc->completed = 0;
+	gc->failed = 0;
+	gc->syncing = 0;
+	gc->writes = 0;
+	gc->durable = 0;
+}
+
+void
+group_commit_write(GROUP_COMMIT* gc)
+{
+	__atomic_add_fetch(&gc->writes, 1, __ATOMIC_RELEASE);
+}
+
+int
+group_commit_sync(GROUP_COMMIT* gc, int fd)
+{
+	// clean : everything completed before is covered by finished sync
+	if (__atomic_load_n(&gc->writes, __ATOMIC_ACQUIRE) == __atomic_load_n(&gc->durable, __ATOMIC_ACQUIRE))
+		return 0;
+
+	group_commit_lock(gc);
+	uint64_t ticket = ++gc->requested;
+	while (gc->completed < ticket)
+	{
+		if (gc->syncing)
+		{
+			if (pthread_cond_wait(&gc->cond, &gc->lock) == EOWNERDEAD)
+			{
+				gc->syncing = 0;
+				pthread_mutex_consistent(&gc->lock);
+			}
+			continue;
+		}
+		// leader : sync covers all tickets given so far
+		uint64_t covers = gc->requested;
+		uint64_t writes = __atomic_load_n(&gc->writes, __ATOMIC_ACQUIRE);
+		gc->syncing = 1;
+		pthread_mutex_unlock(&gc->lock);
+
+		int rc = fdatasync(fd);
+
+		group_commit_lock(gc);
+		gc->syncing = 0;
+		if (covers > gc->completed)
+			gc->completed = covers;
+		if (rc == -1 && covers > gc->failed)
+			gc->failed = covers;
+		if (rc == 0 && writes > gc->durable)
+			__atomic_store_n(&gc->durable, writes, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&gc->cond);
+	}
+	int rc = ticket <= gc->failed ? -1 : 0;
+	pthread_mutex_unlock(&gc->lock);
+	return rc;
+}
+
+void
+group_commit_destroy(GROUP_COMMIT* gc)
+{
+	pthread_mutex_destroy(&gc->lock);
+	pthread_cond_destroy(&gc->cond);
+}
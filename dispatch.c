@@ -0,0 +1,219 @@
+/**
+ * dispatch.c
+ * Out-of-order execution of transmission requests.
+ * Requests of all connections go to one process-wide queue served by
+ * a pool of threads; each connection limits its own requests in flight.
+ * Replies are serialized by connection's send lock (see handle_transmission)
+**/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+#include "includes/functions.h"
+#include "includes/server.h"
+#include "includes/dispatch.h"
+#include "includes/buffer.h"
+
+/*
+ * request waiting for pool thread
+*/
+typedef struct DISPATCH_JOB
+{
+	struct DISPATCH_JOB*	next;
+	DISPATCHER*				d;
+	NBD_REQUEST_HEADER		header;
+	void*					data;
+} DISPATCH_JOB;
+
+static pthread_mutex_t	pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	pool_cond = PTHREAD_COND_INITIALIZER;
+static DISPATCH_JOB*	pool_head = NULL;
+static DISPATCH_JOB*	pool_tail = NULL;
+static uint32_t			pool_threads = 0;
+
+
+/*
+ * execute request and account its completion
+*/
+static void
+dispatch_run(DISPATCH_JOB* job)
+{
+	DISPATCHER* d = job->d;
+	int rc = handle_transmission(d->client, &job->header, job->data, d->fd);
+	buffer_put(job->data, job->header.length);
+	free(job);
+
+	pthread_mutex_lock(&d->lock);
+	d->inflight--;
+	if (rc == -1 && !d->failed)
+	{
+		// reader is woken up by closed socket
+		d->failed = 1;
+		shutdown(d->client->socket, SHUT_RDWR);
+	}
+	if (d->paused && (d->inflight < d->depth || d->failed) && !d->closing)
+	{
+		d->paused = 0;
+		if (d->resume != NULL)
+			d->resume(d->arg);
+	}
+	int release = d->closing && d->inflight == 0;
+	pthread_cond_broadcast(&d->cond);
+	pthread_mutex_unlock(&d->lock);
+
+	if (release && d->release != NULL)
+		d->release(d->arg);
+}
+
+/*
+ * pool thread
+*/
+static void*
+dispatch_thread(void* arg)
+{
+	while (1)
+	{
+		pthread_mutex_lock(&pool_lock);
+		while (pool_head == NULL)
+			pthread_cond_wait(&pool_cond, &pool_lock);
+		DISPATCH_JOB* job = pool_head;
+		pool_head = job->next;
+		if (pool_head == NULL)
+			pool_tail = NULL;
+		pthread_mutex_unlock(&pool_lock);
+
+		dispatch_run(job);
+	}
+	return NULL;
+}
+
+void
+dispatch_pool_start(uint32_t threads)
+{
+	pthread_mutex_lock(&pool_lock);
+	for (; pool_threads < threads; pool_threads++)
+	{
+		pthread_t t;
+		if (pthread_create(&t, NULL, dispatch_thread, NULL))
+		{
+			ERROR("dispatch thread creation error\n");
+			exit(EXIT_FAILURE);
+		}
+		pthread_detach(t);
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
+
+void
+dispatcher_init(DISPATCHER* d, NBD_CLIENT* client, uint32_t fd, uint32_t depth)
+{
+	d->client = client;
+	d->fd = fd;
+	d->depth = depth ? depth : 1;
+	d->inflight = 0;
+	d->paused = 0;
+	d->closing = 0;
+	d->failed = 0;
+	d->pause = NULL;
+	d->resume = NULL;
+	d->release = NULL;
+	d->arg = NULL;
+	pthread_mutex_init(&d->lock, NULL);
+	pthread_cond_init(&d->cond, NULL);
+	if (d->depth > 1)
+		dispatch_pool_start(d->depth);
+}
+
+void
+dispatcher_destroy(DISPATCHER* d)
+{
+	pthread_mutex_destroy(&d->lock);
+	pthread_cond_destroy(&d->cond);
+}
+
+int
+dispatch_submit(DISPATCHER* d, NBD_REQUEST_HEADER* header, void* data)
+{
+	// without pipelining request is handled by reader itself
+	if (d->depth == 1)
+	{
+		int rc = handle_transmission(d->client, header, data, d->fd);
+		buffer_put(data, header->length);
+		if (rc == -1)
+			d->failed = 1;
+		return rc == -1 ? -1 : 0;
+	}
+
+	DISPATCH_JOB* job = (DISPATCH_JOB*) malloc(sizeof(DISPATCH_JOB));
+	if (job == NULL)
+	{
+		ERROR("malloc error\n");
+		buffer_put(data, header->length);
+		return -1;
+	}
+	job->next = NULL;
+	job->d = d;
+	job->header = *header;
+	job->data = data;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->failed)
+	{
+		pthread_mutex_unlock(&d->lock);
+		buffer_put(job->data, job->header.length);
+		free(job);
+		return -1;
+	}
+	d->inflight++;
+	int full = d->inflight >= d->depth;
+	if (full)
+	{
+		d->paused = 1;
+		if (d->pause != NULL)
+			d->pause(d->arg);
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	pthread_mutex_lock(&pool_lock);
+	if (pool_tail == NULL)
+		pool_head = job;
+	else
+		pool_tail->next = job;
+	pool_tail = job;
+	pthread_cond_signal(&pool_cond);
+	pthread_mutex_unlock(&pool_lock);
+	return full;
+}
+
+int
+dispatch_wait(DISPATCHER* d)
+{
+	pthread_mutex_lock(&d->lock);
+	while (d->paused && !d->failed)
+		pthread_cond_wait(&d->cond, &d->lock);
+	int rc = d->failed ? -1 : 0;
+	pthread_mutex_unlock(&d->lock);
+	return rc;
+}
+
+int
+dispatch_drain(DISPATCHER* d)
+{
+	pthread_mutex_lock(&d->lock);
+	while (d->inflight > 0)
+		pthread_cond_wait(&d->cond, &d->lock);
+	int rc = d->failed ? -1 : 0;
+	pthread_mutex_unlock(&d->lock);
+	return rc;
+}
+
+int
+dispatch_close(DISPATCHER* d)
+{
+	pthread_mutex_lock(&d->lock);
+	d->closing = 1;
+	int release = d->inflight == 0;
+	pthread_mutex_unlock(&d->lock);
+	return release;
+}
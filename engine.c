@@ -0,0 +1,391 @@
+/**
+ * engine.c
+ * Event-driven connection engine: instead of fork() per accept(),
+ * a fixed number of worker threads, each of them multiplexes many
+ * non-blocking connections with epoll. Every connection is a small
+ * state machine (handshake -> options -> transmission) which collects
+ * messages from socket and passes them to the same handlers the
+ * fork mode uses (handle_option, handle_transmission)
+ * Vlasov Roman. June 2021
+**/
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "includes/nbd.h"
+#include "includes/functions.h"
+#include "includes/server.h"
+#include "includes/engine.h"
+#include "includes/dispatch.h"
+#include "includes/buffer.h"
+
+#define ENGINE_MAX_EVENTS	64
+
+/*
+ * states of connection (which message is expected from client)
+*/
+enum
+{
+	CONN_HS_CLIENT,		// HANDSHAKE_CLIENT
+	CONN_OPT_HEADER,	// OPTION_REQUEST_HEADER
+	CONN_OPT_DATA,		// data of option
+	CONN_REQ_HEADER,	// NBD_REQUEST_HEADER
+	CONN_REQ_DATA,		// payload of NBD_CMD_WRITE
+};
+
+/*
+ * connection served by engine
+*/
+typedef struct
+{
+	NBD_CLIENT				client;
+	int						epfd;		// epoll of worker serving connection
+	int						state;
+	RESOURCE*				res;		// export chosen by NBD_OPT_GO
+	DISPATCHER				d;			// requests in flight (since NBD_OPT_GO)
+	HANDSHAKE_CLIENT		hs;
+	OPTION_REQUEST_HEADER	opt_header;
+	NBD_REQUEST_HEADER		req_header;
+	char*					data;		// option data or write payload
+	char*					buf;		// where current message is collected
+	uint32_t				need;		// size of current message
+	uint32_t				have;		// already received bytes of it
+} ENGINE_CONN;
+
+/*
+ * worker thread with its own epoll instance
+*/
+typedef struct
+{
+	pthread_t	thread;
+	int			epfd;
+} ENGINE_WORKER;
+
+
+/*
+ * wait for the next message of `need` bytes into buf
+*/
+static void
+conn_expect(ENGINE_CONN* conn, int state, void* buf, uint32_t need)
+{
+	conn->state = state;
+	conn->buf = buf;
+	conn->need = need;
+	conn->have = 0;
+}
+
+/*
+ * free connection and everything it owns
+*/
+static void
+conn_free(void* arg)
+{
+	ENGINE_CONN* conn = arg;
+	close(conn->client.socket);
+	if (conn->res != NULL)
+	{
+		dispatcher_destroy(&conn->d);
+		export_detach(conn->res->state);
+	}
+	pthread_mutex_destroy(&conn->client.send_lock);
+	// payload which was being received
+	buffer_put(conn->data, conn->state == CONN_OPT_DATA ? conn->opt_header.len : conn->req_header.length);
+	free(conn);
+	INFO("... Connection is closed ...\n");
+}
+
+/*
+ * drop connection : it is freed when its last request in flight is completed
+*/
+static void
+conn_close(ENGINE_CONN* conn)
+{
+	epoll_ctl(conn->epfd, EPOLL_CTL_DEL, conn->client.socket, NULL);
+	if (conn->res != NULL && !dispatch_close(&conn->d))
+		return;
+	conn_free(conn);
+}
+
+/*
+ * in-flight queue is full : stop reading requests
+*/
+static void
+conn_pause(void* arg)
+{
+	ENGINE_CONN* conn = arg;
+	struct epoll_event ev;
+	ev.events = EPOLLRDHUP;
+	ev.data.ptr = conn;
+	epoll_ctl(conn->epfd, EPOLL_CTL_MOD, conn->client.socket, &ev);
+}
+
+/*
+ * in-flight queue has room again
+*/
+static void
+conn_resume(void* arg)
+{
+	ENGINE_CONN* conn = arg;
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = conn;
+	epoll_ctl(conn->epfd, EPOLL_CTL_MOD, conn->client.socket, &ev);
+}
+
+/*
+ * complete option request is received : handle it like handshake() does
+ * returns 0 or -1 (connection must be dropped)
+*/
+static int
+conn_option(ENGINE_CONN* conn)
+{
+	OPTION_REQUEST req = {
+		&conn->opt_header,
+		conn->data,
+	};
+	OPTION_RESULT result;
+	int rc = handle_option(&conn->client, &req, &result);
+	buffer_put(conn->data, conn->opt_header.len);
+	conn->data = NULL;
+	if (rc)
+		return -1;
+
+	int last_opt = result.last_opt;
+	RESOURCE* res = result.res;
+	if (last_opt == NBD_OPT_ABORT)
+	{
+		INFO("abord (handshake)\n");
+		return -1;
+	}
+	if (last_opt == NBD_OPT_GO)
+	{
+		conn->res = res;
+		conn->client.res = res;
+		dispatcher_init(&conn->d, &conn->client, res->fd, conn->client.serv->depth);
+		conn->d.pause = conn_pause;
+		conn->d.resume = conn_resume;
+		conn->d.release = conn_free;
+		conn->d.arg = conn;
+		INFO("... Handshake is established ....\n");
+		INFO("\n<<< Transmission phase >>>\n\n");
+		conn_expect(conn, CONN_REQ_HEADER, &conn->req_header, sizeof(NBD_REQUEST_HEADER));
+		return 0;
+	}
+	conn_expect(conn, CONN_OPT_HEADER, &conn->opt_header, sizeof(OPTION_REQUEST_HEADER));
+	return 0;
+}
+
+/*
+ * complete transmission request is received : pass it to dispatcher
+ * returns 0, 1 (queue is full, stop reading) or -1 (connection must be dropped)
+*/
+static int
+conn_request(ENGINE_CONN* conn)
+{
+	if (conn->req_header.type == NBD_CMD_DISC)
+		return -1;
+	int rc = dispatch_submit(&conn->d, &conn->req_header, conn->data);
+	conn->data = NULL;
+	if (rc == -1)
+		return -1;
+	conn_expect(conn, CONN_REQ_HEADER, &conn->req_header, sizeof(NBD_REQUEST_HEADER));
+	return rc;
+}
+
+/*
+ * current message is collected : move state machine forward
+ * returns 0, 1 (stop reading) or -1 (connection must be dropped)
+*/
+static int
+conn_advance(ENGINE_CONN* conn)
+{
+	switch (conn->state)
+	{
+		case CONN_HS_CLIENT:
+			if (handshake_type(conn->hs.clflags) != 0)
+			{
+				ERROR("... Handshake is not established ...\n");
+				return -1;
+			}
+			INFO("\n<<< Option phase >>>\n\n");
+			conn_expect(conn, CONN_OPT_HEADER, &conn->opt_header, sizeof(OPTION_REQUEST_HEADER));
+			return 0;
+
+		case CONN_OPT_HEADER:
+			if (option_request_decode(&conn->opt_header))
+				return -1;
+			if (conn->opt_header.len == 0)
+				return conn_option(conn);
+			conn->data = (char*) buffer_get(conn->opt_header.len);
+			if (conn->data == NULL)
+			{
+				ERROR("malloc error\n");
+				return -1;
+			}
+			conn_expect(conn, CONN_OPT_DATA, conn->data, conn->opt_header.len);
+			return 0;
+
+		case CONN_OPT_DATA:
+			return conn_option(conn);
+
+		case CONN_REQ_HEADER:
+			if (nbd_request_decode(&conn->req_header))
+				return -1;
+			// when we get cmd to write we must recieve all data from socket
+			if (conn->req_header.type != NBD_CMD_WRITE || conn->req_header.length == 0)
+				return conn_request(conn);
+			conn->data = (char*) buffer_get(conn->req_header.length);
+			if (conn->data == NULL)
+			{
+				ERROR("malloc error\n");
+				return -1;
+			}
+			conn_expect(conn, CONN_REQ_DATA, conn->data, conn->req_header.length);
+			return 0;
+
+		case CONN_REQ_DATA:
+			return conn_request(conn);
+	}
+	return -1;
+}
+
+/*
+ * read everything socket has, handling each collected message
+ * returns 0 or -1 (connection must be dropped)
+*/
+static int
+conn_read(ENGINE_CONN* conn)
+{
+	while (1)
+	{
+		ssize_t cnt = read(conn->client.socket, conn->buf + conn->have, conn->need - conn->have);
+		if (cnt == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			ERROR("read from socket error\n");
+			return -1;
+		}
+		if (cnt == 0)
+			return -1;
+		conn->have += cnt;
+		if (conn->have == conn->need)
+		{
+			int rc = conn_advance(conn);
+			if (rc)
+				return rc == 1 ? 0 : -1;
+		}
+	}
+}
+
+/*
+ * event loop of one worker
+*/
+static void*
+engine_worker(void* arg)
+{
+	ENGINE_WORKER* w = arg;
+	struct epoll_event events[ENGINE_MAX_EVENTS];
+	while (1)
+	{
+		int n = epoll_wait(w->epfd, events, ENGINE_MAX_EVENTS, -1);
+		if (n == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			ERROR("epoll_wait lcall error\n");
+			exit(EXIT_FAILURE);
+		}
+		for (int i = 0; i < n; i++)
+		{
+			ENGINE_CONN* conn = events[i].data.ptr;
+			if (conn_read(conn))
+				conn_close(conn);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Accept clients and distribute them between workers (round-robin)
+*/
+int
+engine_run(NBD_SERVER* serv, uint32_t workers)
+{
+	// write to closed socket must fail that connection only, not the whole server
+	signal(SIGPIPE, SIG_IGN);
+
+	ENGINE_WORKER* w = (ENGINE_WORKER*) calloc(workers, sizeof(ENGINE_WORKER));
+	if (w == NULL)
+	{
+		ERROR("malloc error\n");
+		return -1;
+	}
+	for (uint32_t i = 0; i < workers; i++)
+	{
+		w[i].epfd = epoll_create1(0);
+		if (w[i].epfd == -1 || pthread_create(&w[i].thread, NULL, engine_worker, &w[i]))
+		{
+			ERROR("engine worker init error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	INFO("... Epoll engine is started : %u workers ...\n", workers);
+
+	uint32_t next = 0;
+	while (1)
+	{
+		int connect_fd = accept(serv->socket, (struct sockaddr*) NULL, NULL);
+		if (connect_fd == -1)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			ERROR("accept lcall error\n");
+			exit(EXIT_FAILURE);
+		}
+		ENGINE_CONN* conn = (ENGINE_CONN*) calloc(1, sizeof(ENGINE_CONN));
+		if (conn == NULL)
+		{
+			ERROR("malloc error\n");
+			close(connect_fd);
+			continue;
+		}
+		conn->client.serv = serv;
+		conn->client.socket = connect_fd;
+		conn->client.seq = 0;
+		conn->client.meta = 0;
+		pthread_mutex_init(&conn->client.send_lock, NULL);
+		conn->epfd = w[next].epfd;
+
+		INFO("\n<<< Handshake phase >>>\n\n");
+		fcntl(connect_fd, F_SETFL, fcntl(connect_fd, F_GETFL) | O_NONBLOCK);
+		if (handshake_server(connect_fd, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES))
+		{
+			conn_close(conn);
+			continue;
+		}
+		conn_expect(conn, CONN_HS_CLIENT, &conn->hs, sizeof(HANDSHAKE_CLIENT));
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.ptr = conn;
+		if (epoll_ctl(w[next].epfd, EPOLL_CTL_ADD, connect_fd, &ev))
+		{
+			ERROR("epoll_ctl lcall error\n");
+			conn_close(conn);
+			continue;
+		}
+		next = (next + 1) % workers;
+	}
+	return 0;
+}
@@ -0,0 +1,41 @@
+/**
+ * export.c
+ * Shared per-export state
+**/
+
+#include <sys/mman.h>
+
+#include "includes/export.h"
+
+EXPORT_STATE*
+export_state_create(void)
+{
+	EXPORT_STATE* st = mmap(NULL, sizeof(EXPORT_STATE), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (st == MAP_FAILED)
+		return NULL;
+	group_commit_init(&st->commit);
+	st->clients = 0;
+	extent_cache_init(&st->extents);
+	return st;
+}
+
+void
+export_state_destroy(EXPORT_STATE* st)
+{
+	group_commit_destroy(&st->commit);
+	extent_cache_destroy(&st->extents);
+	munmap(st, sizeof(EXPORT_STATE));
+}
+
+uint32_t
+export_attach(EXPORT_STATE* st)
+{
+	return __atomic_add_fetch(&st->clients, 1, __ATOMIC_RELAXED);
+}
+
+uint32_t
+export_detach(EXPORT_STATE* st)
+{
+	return __atomic_sub_fetch(&st->clients, 1, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,207 @@
+/**
+ * extent.c
+ * Data/hole layout of export's file
+**/
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "includes/extent.h"
+
+/*
+ * append extent, merging it with previous one of the same type
+*/
+static int
+extent_add(EXTENT* ext, int n, uint64_t offset, uint64_t end, uint32_t flags)
+{
+	if (n > 0 && ext[n - 1].flags == flags)
+	{
+		ext[n - 1].length += end - offset;
+		return n;
+	}
+	ext[n].offset = offset;
+	ext[n].length = end - offset;
+	ext[n].flags = flags;
+	return n + 1;
+}
+
+int
+file_extents(int fd, uint64_t offset, uint32_t length, EXTENT* ext, int max)
+{
+	uint64_t pos = offset, end = offset + length;
+	int n = 0;
+	while (pos < end)
+	{
+		// no room : the rest is reported as data
+		if (n >= max - 1)
+			return extent_add(ext, n, pos, end, 0);
+
+		off_t data = lseek(fd, pos, SEEK_DATA);
+		if (data == -1)
+		{
+			// ENXIO : no data after pos, otherwise file system can't tell
+			return extent_add(ext, n, pos, end, errno == ENXIO ? EXTENT_HOLE : 0);
+		}
+		if (data > pos)
+		{
+			uint64_t hole_end = (uint64_t) data < end ? (uint64_t) data : end;
+			n = extent_add(ext, n, pos, hole_end, EXTENT_HOLE);
+			pos = hole_end;
+			if (pos == end)
+				break;
+		}
+
+		off_t hole = lseek(fd, pos, SEEK_HOLE);
+		uint64_t data_end = hole == -1 || (uint64_t) hole > end ? end : (uint64_t) hole;
+		if (data_end <= pos)
+			data_end = end;
+		n = extent_add(ext, n, pos, data_end, 0);
+		pos = data_end;
+	}
+	return n;
+}
+
+
+/*
+ * lock shared cache (client process could die holding the lock)
+*/
+static void
+extent_cache_lock(EXTENT_CACHE* c)
+{
+	if (pthread_mutex_lock(&c->lock) == EOWNERDEAD)
+	{
+		// slot could be half-written : forget everything
+		for (int i = 0; i < EXTENT_CACHE_SLOTS; i++)
+		{
+			c->slot[i].region = 0;
+			c->slot[i].version++;
+		}
+		pthread_mutex_consistent(&c->lock);
+	}
+}
+
+void
+extent_cache_init(EXTENT_CACHE* c)
+{
+	pthread_mutexattr_t ma;
+	pthread_mutexattr_init(&ma);
+	pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&c->lock, &ma);
+	pthread_mutexattr_destroy(&ma);
+	memset(c->slot, 0, sizeof(c->slot));
+}
+
+void
+extent_cache_destroy(EXTENT_CACHE* c)
+{
+	pthread_mutex_destroy(&c->lock);
+}
+
+/*
+ * extents of the whole region r (from cache or file system)
+ * returns number of extents or -1 (region is too fragmented to be cached)
+*/
+static int
+extent_cache_region(EXTENT_CACHE* c, int fd, uint64_t r, EXTENT* ext)
+{
+	EXTENT_SLOT* slot = &c->slot[r % EXTENT_CACHE_SLOTS];
+
+	extent_cache_lock(c);
+	if (slot->region == r + 1)
+	{
+		int n = slot->n;
+		memcpy(ext, slot->ext, sizeof(EXTENT) * n);
+		pthread_mutex_unlock(&c->lock);
+		return n;
+	}
+	uint32_t version = slot->version;
+	pthread_mutex_unlock(&c->lock);
+
+	// miss : ask file system without lock
+	EXTENT tmp[EXTENT_REGION_MAX + 1];
+	int n = file_extents(fd, r << EXTENT_REGION_SHIFT, 1 << EXTENT_REGION_SHIFT, tmp, EXTENT_REGION_MAX + 1);
+	if (n > EXTENT_REGION_MAX)
+		return -1;
+
+	extent_cache_lock(c);
+	// region could be written meanwhile : then the result is not cached
+	if (slot->version == version)
+	{
+		slot->region = r + 1;
+		slot->n = n;
+		memcpy(slot->ext, tmp, sizeof(EXTENT) * n);
+	}
+	pthread_mutex_unlock(&c->lock);
+	memcpy(ext, tmp, sizeof(EXTENT) * n);
+	return n;
+}
+
+int
+extent_cache_lookup(EXTENT_CACHE* c, int fd, uint64_t offset, uint32_t length, EXTENT* ext, int max)
+{
+	uint64_t pos = offset, end = offset + length;
+	int n = 0;
+	while (pos < end)
+	{
+		uint64_t r = pos >> EXTENT_REGION_SHIFT;
+		uint64_t r_end = (r + 1) << EXTENT_REGION_SHIFT;
+		uint64_t stop = r_end < end ? r_end : end;
+
+		EXTENT region[EXTENT_REGION_MAX];
+		int rn = extent_cache_region(c, fd, r, region);
+		if (rn == -1)
+		{
+			// fragmented region : ask file system about requested part only
+			EXTENT tmp[EXTENT_MAX];
+			int tn = file_extents(fd, pos, stop - pos, tmp, EXTENT_MAX);
+			for (int i = 0; i < tn; i++)
+			{
+				if (n >= max - 1)
+					return extent_add(ext, n, tmp[i].offset, end, 0);
+				n = extent_add(ext, n, tmp[i].offset, tmp[i].offset + tmp[i].length, tmp[i].flags);
+			}
+			pos = stop;
+			continue;
+		}
+		// clip region's extents to the requested range
+		for (int i = 0; i < rn; i++)
+		{
+			uint64_t e_start = region[i].offset, e_end = region[i].offset + region[i].length;
+			if (e_end <= pos || e_start >= stop)
+				continue;
+			if (e_start < pos)
+				e_start = pos;
+			if (e_end > stop)
+				e_end = stop;
+			if (n >= max - 1)
+				return extent_add(ext, n, e_start, end, 0);
+			n = extent_add(ext, n, e_start, e_end, region[i].flags);
+		}
+		pos = stop;
+	}
+	return n;
+}
+
+void
+extent_cache_invalidate(EXTENT_CACHE* c, uint64_t offset, uint64_t length)
+{
+	if (length == 0)
+		return;
+	uint64_t first = offset >> EXTENT_REGION_SHIFT;
+	uint64_t last = (offset + length - 1) >> EXTENT_REGION_SHIFT;
+	// each slot is touched once even for huge ranges
+	if (last - first >= EXTENT_CACHE_SLOTS)
+		last = first + EXTENT_CACHE_SLOTS - 1;
+
+	extent_cache_lock(c);
+	for (uint64_t r = first; r <= last; r++)
+	{
+		EXTENT_SLOT* slot = &c->slot[r % EXTENT_CACHE_SLOTS];
+		slot->region = 0;
+		slot->version++;
+	}
+	pthread_mutex_unlock(&c->lock);
+}
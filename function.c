@@ -2,6 +2,10 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/sendfile.h>
 #include <stdint.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
@@ -37,46 +41,121 @@ htonll(const unsigned long long input)
 	return ntohll(input);
 }
 
+/*
+ * wait until non-blocking socket is ready for the given poll events
+*/
+static void
+wait_socket(int socket, short events)
+{
+	struct pollfd pfd = { socket, events, 0 };
+	poll(&pfd, 1, -1);
+}
+
 // send to socket
-void
+int
 send_socket(int socket, void* data, int len)
 {
-	if (write(socket, data, len) == -1)
+	char* p = data;
+	while (len > 0)
 	{
-		ERROR("write to socket error");
-		exit(EXIT_FAILURE);
+		ssize_t cnt = write(socket, p, len);
+		if (cnt == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				wait_socket(socket, POLLOUT);
+				continue;
+			}
+			ERROR("write to socket error\n");
+			return -1;
+		}
+		p += cnt;
+		len -= cnt;
 	}
+	return 0;
 } 
 
 // get data from socket
-void
+int
 recv_socket(int socket, void* data, int len)
 {	
-	int cnt = read(socket, data, len);
-	int acc = cnt;
-	while (acc != len && cnt != -1)
+	char* p = data;
+	while (len > 0)
+	{
+		ssize_t cnt = read(socket, p, len);
+		if (cnt == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				wait_socket(socket, POLLIN);
+				continue;
+			}
+		}
+		if (cnt <= 0)
+		{
+			ERROR("read from socket error\n");
+			return -1;
+		}
+		p += cnt;
+		len -= cnt;
+	}
+	return 0;
+} 
+
+// send file's region to socket (without copy to user space)
+int
+sendfile_socket(int socket, int fd, uint64_t offset, uint32_t len)
+{
+	off_t off = offset;
+	while (len > 0)
 	{
-		cnt = read(socket, data, len);
-		acc += cnt;
+		ssize_t cnt = sendfile(socket, fd, &off, len);
+		if (cnt == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				wait_socket(socket, POLLOUT);
+				continue;
+			}
+			ERROR("sendfile to socket error\n");
+			return -1;
+		}
+		if (cnt == 0)
+			break;	// end of file
+		len -= cnt;
 	}
-	if (cnt == 0)
+	// client waits exactly len bytes : tail after end of file is zeroes
+	char zeroes[4096];
+	memset(zeroes, 0, sizeof(zeroes));
+	while (len > 0)
 	{
-		ERROR("read from socket error");
-		exit(EXIT_FAILURE);
+		uint32_t l = len < sizeof(zeroes) ? len : sizeof(zeroes);
+		if (send_socket(socket, zeroes, l))
+			return -1;
+		len -= l;
 	}
-} 
+	return 0;
+}
 
 /*
  * return size of file (even file is blk)
 */
-int 
-get_file_size(int fd) 
+int64_t 
+get_file_size(int fd, uint16_t* blockdev) 
 {
 	struct stat st;
 	if (fstat(fd, &st) < 0)
 	{ 
 		return -1;
 	}
+	if (blockdev != NULL)
+		*blockdev = S_ISBLK(st.st_mode);
 	if (S_ISBLK(st.st_mode))
 	{
 		uint64_t bs;
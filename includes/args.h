@@ -3,12 +3,19 @@
 
 #include <stdint.h>
 
+#include "export.h"
+
 /**
  * Struct of command line arguments
 **/
 typedef struct
 {
 	uint32_t 	port;
+	uint32_t	workers;	// epoll workers, 0 - fork per client
+	char*		backend;	// storage backend name
+	uint16_t	zerocopy;	// READ replies by sendfile
+	uint32_t	depth;		// transmission requests in flight per client
+	uint32_t	pool;		// request buffers pool (MB)
 	char** 		lf_path_name;
 	uint32_t	n;
 } CMD_ARGS;
@@ -16,8 +23,13 @@ typedef struct
 
 /**
  * Function that check argv line
- *	 1st arg - binded port
- *	 2nd arg - path to shared file
+ *	 -p - binded port
+ *	 -w - number of epoll workers (0 - fork per client)
+ *	 -b - storage backend (sync, uring, uring-reg)
+ *	 -z - zero-copy READ replies (sendfile)
+ *	 -q - max transmission requests in flight per client
+ *	 -m - memory of request buffers pool (MB)
+ *	 -d - (path to shared file, exportname) pairs until the end of line
 **/
 CMD_ARGS* valid_cmdline(int argc, char* argv[]);
 
@@ -27,9 +39,12 @@ CMD_ARGS* valid_cmdline(int argc, char* argv[]);
 **/
 typedef struct
 {
-	char* 		exportname;
-	uint16_t	fd;
-	uint64_t	size;
+	char* 			exportname;
+	uint16_t		fd;
+	uint64_t		size;
+	uint16_t		readonly;	// file can't be opened for writing
+	uint16_t		blockdev;	// file is block device (discard/zeroing by ioctl)
+	EXPORT_STATE*	state;		// shared by all connections to export
 } RESOURCE;
 
 /*
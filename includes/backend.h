@@ -0,0 +1,88 @@
+/**
+ * backend.h
+ * Storage backend: how NBD_CMD_READ/NBD_CMD_WRITE reach export's file
+ *   sync      - pread/pwrite
+ *   uring     - io_uring (batched submission and completion)
+ *   uring-reg - io_uring with registered files and buffers
+**/
+
+#ifndef __BACKEND_NBD_SERVER_H
+#define __BACKEND_NBD_SERVER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define BACKEND_SYNC		0
+#define BACKEND_URING		1
+#define BACKEND_URING_REG	2
+
+#define BACKEND_READ		0
+#define BACKEND_WRITE		1
+
+// large requests are split to chunks which are in flight at the same time
+#define BACKEND_CHUNK		(128 * 1024)
+#define BACKEND_QUEUE_DEPTH	64
+
+/*
+ * one I/O of a batch
+*/
+typedef struct
+{
+	int			op;		// BACKEND_READ / BACKEND_WRITE
+	int			fd;
+	void*		buf;
+	uint32_t	len;
+	uint64_t	offset;
+	int64_t		res;	// transferred bytes or -errno
+} BACKEND_IO;
+
+
+/**
+ * choose backend by name (sync, uring, uring-reg)
+ * if io_uring is not available at runtime falls back to sync
+ * returns chosen backend or -1 (unknown name)
+**/
+int backend_select(const char* name);
+
+/**
+ * export's files to register in every io_uring (uring-reg only)
+**/
+void backend_register_files(int* fds, int n);
+
+/**
+ * memory area to register in every io_uring as fixed buffer (uring-reg only);
+ * I/O into this area uses READ_FIXED/WRITE_FIXED
+ * returns 0 or -1 (no free slots)
+**/
+int backend_register_buffer(void* base, size_t len);
+
+/**
+ * execute batch of I/Os, every io->res is set
+ * returns 0 or -1 (any I/O failed)
+**/
+int backend_submit(BACKEND_IO* io, int n);
+
+/**
+ * read/write len bytes at offset (short only at end of file)
+ * returns transferred bytes or -1
+**/
+ssize_t backend_read(int fd, void* buf, uint32_t len, uint64_t offset);
+ssize_t backend_write(int fd, void* buf, uint32_t len, uint64_t offset);
+
+/**
+ * discard [offset, offset + len) : hole in regular file, BLKDISCARD on block device
+ * (discarding is advisory : not supported -> nothing is done)
+ * returns 0 or -1
+**/
+int backend_discard(int fd, int blockdev, uint64_t offset, uint64_t len);
+
+/**
+ * zero [offset, offset + len) without sending zeroes through memory
+ * (hole may be punched unless no_hole is set, zeroes are written
+ * when file system can't do it itself)
+ * returns 0 or -1
+**/
+int backend_zero(int fd, int blockdev, uint64_t offset, uint64_t len, int no_hole);
+
+#endif
@@ -0,0 +1,44 @@
+/**
+ * buffer.h
+ * Pool of page-aligned buffers for request payloads and read replies.
+ * Buffers are carved from one arena (hard cap of pool's memory) in
+ * power-of-two size classes and reused; every thread keeps a few
+ * small buffers of its own to skip the pool lock
+**/
+
+#ifndef __BUFFER_NBD_SERVER_H
+#define __BUFFER_NBD_SERVER_H
+
+#include <stddef.h>
+
+#define BUFFER_MIN_SHIFT	12		// 4 KB
+#define BUFFER_MAX_SHIFT	25		// 32 MB (largest request)
+#define BUFFER_CLASSES		(BUFFER_MAX_SHIFT - BUFFER_MIN_SHIFT + 1)
+
+// classes up to this one are carved from slabs and cached by threads
+#define BUFFER_SLAB_SHIFT	20		// 1 MB slabs
+#define BUFFER_THREAD_CACHE	4		// buffers of each class kept by thread
+
+#define BUFFER_DEFAULT_CAP	(256UL << 20)
+
+
+/**
+ * reserve arena of cap bytes (at least one largest buffer)
+ * and register it as fixed buffer of storage backend
+ * returns 0 or -1
+**/
+int buffer_pool_init(size_t cap);
+
+/**
+ * buffer of at least len bytes (page-aligned)
+ * when arena is exhausted buffer is allocated outside the pool
+ * returns NULL on error
+**/
+void* buffer_get(size_t len);
+
+/**
+ * return buffer taken by buffer_get(len) (NULL is ignored)
+**/
+void buffer_put(void* buf, size_t len);
+
+#endif
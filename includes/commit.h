@@ -0,0 +1,50 @@
+/**
+ * commit.h
+ * Group commit of durability requests (NBD_CMD_FLUSH, NBD_CMD_FLAG_FUA):
+ * concurrent requests of all clients of an export share one fdatasync
+**/
+
+#ifndef __COMMIT_NBD_SERVER_H
+#define __COMMIT_NBD_SERVER_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * sync state of export
+ * (lives in shared memory : forked clients see the same state)
+*/
+typedef struct
+{
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;		// sync is completed
+	uint64_t		requested;	// last ticket given to durability request
+	uint64_t		completed;	// all tickets up to this are durable
+	uint64_t		failed;		// tickets up to this were in failed sync
+	int				syncing;	// fdatasync is in progress
+	uint64_t		writes;		// write generation : completed writes
+	uint64_t		durable;	// write generation covered by last sync
+} GROUP_COMMIT;
+
+
+/**
+ * init sync state in memory shared between threads and processes
+**/
+void group_commit_init(GROUP_COMMIT* gc);
+
+/**
+ * account completed write (flush after it can't be skipped)
+**/
+void group_commit_write(GROUP_COMMIT* gc);
+
+/**
+ * make everything written to fd before the call durable;
+ * waits for running sync or leads the next one for all waiters
+ * (nothing to do if there were no writes since last sync)
+ * returns 0 or -1 (sync failed)
+**/
+int group_commit_sync(GROUP_COMMIT* gc, int fd);
+
+void group_commit_destroy(GROUP_COMMIT* gc);
+
+#endif
@@ -0,0 +1,83 @@
+/**
+ * dispatch.h
+ * Pipelining of transmission requests: reader submits decoded requests,
+ * pool threads execute them concurrently, replies are sent in completion
+ * order (client matches them by handle)
+**/
+
+#ifndef __DISPATCH_NBD_SERVER_H
+#define __DISPATCH_NBD_SERVER_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "nbd.h"
+#include "server.h"
+
+/*
+ * in-flight queue of one connection
+*/
+typedef struct
+{
+	NBD_CLIENT*		client;
+	uint32_t		fd;
+	uint32_t		depth;		// max requests in flight (1 - no pipelining)
+	uint32_t		inflight;
+	int				paused;		// queue is full, reader waits
+	int				closing;	// connection is closed by reader
+	int				failed;		// any request failed, connection must be dropped
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;		// inflight is decreased
+	// optional callbacks (called under lock) for event-driven readers
+	void			(*pause)(void* arg);
+	void			(*resume)(void* arg);
+	// called when closing connection has no requests in flight anymore
+	void			(*release)(void* arg);
+	void*			arg;
+} DISPATCHER;
+
+
+/**
+ * start pool of threads which execute requests (once per process)
+**/
+void dispatch_pool_start(uint32_t threads);
+
+/**
+ * init in-flight queue of connection
+**/
+void dispatcher_init(DISPATCHER* d, NBD_CLIENT* client, uint32_t fd, uint32_t depth);
+
+/**
+ * destroy in-flight queue (no requests must be in flight)
+**/
+void dispatcher_destroy(DISPATCHER* d);
+
+/**
+ * submit request (data - buffer_get() buffer owned by dispatcher since now)
+ * returns:
+ *		0  -> there is room for next request
+ *		1  -> queue is full, reader must wait (dispatch_wait or resume callback)
+ *		-1 -> connection failed
+**/
+int dispatch_submit(DISPATCHER* d, NBD_REQUEST_HEADER* header, void* data);
+
+/**
+ * block until queue has room
+ * returns 0 or -1 (connection failed)
+**/
+int dispatch_wait(DISPATCHER* d);
+
+/**
+ * block until all requests are completed
+ * returns 0 or -1 (connection failed)
+**/
+int dispatch_drain(DISPATCHER* d);
+
+/**
+ * reader closes connection
+ * returns 1 if nothing is in flight (caller releases connection itself),
+ * otherwise release callback is called by the last completed request
+**/
+int dispatch_close(DISPATCHER* d);
+
+#endif
@@ -0,0 +1,20 @@
+/**
+ * engine.h
+ * Event-driven connection engine (epoll + fixed pool of worker threads)
+**/
+
+#ifndef __ENGINE_NBD_SERVER_H
+#define __ENGINE_NBD_SERVER_H
+
+#include <stdint.h>
+
+#include "server.h"
+
+/**
+ * Accept clients on serv->socket and serve them by `workers` threads,
+ * each of them multiplexes its non-blocking connections with epoll.
+ * Does not return while server is alive
+**/
+int engine_run(NBD_SERVER* serv, uint32_t workers);
+
+#endif
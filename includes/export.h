@@ -0,0 +1,41 @@
+/**
+ * export.h
+ * State of export shared by all its connections (threads of epoll
+ * engine or forked clients) : flush/write generations, attached clients,
+ * cached layout of export's file.
+ * It makes NBD_FLAG_CAN_MULTI_CONN safe : flush on any connection
+ * covers writes completed on every other one
+**/
+
+#ifndef __EXPORT_NBD_SERVER_H
+#define __EXPORT_NBD_SERVER_H
+
+#include <stdint.h>
+
+#include "commit.h"
+#include "extent.h"
+
+typedef struct
+{
+	GROUP_COMMIT	commit;		// flushes and write generation
+	uint32_t		clients;	// connections attached by NBD_OPT_GO
+	EXTENT_CACHE	extents;	// data/hole regions (reads, NBD_CMD_BLOCK_STATUS)
+} EXPORT_STATE;
+
+
+/**
+ * allocate state in memory shared with forked clients
+ * returns NULL on error
+**/
+EXPORT_STATE* export_state_create(void);
+
+void export_state_destroy(EXPORT_STATE* st);
+
+/**
+ * connection starts/stops transmission on export
+ * returns number of attached connections after the call
+**/
+uint32_t export_attach(EXPORT_STATE* st);
+uint32_t export_detach(EXPORT_STATE* st);
+
+#endif
@@ -0,0 +1,74 @@
+/**
+ * extent.h
+ * Layout of export's file : which regions hold data and which are holes
+**/
+
+#ifndef __EXTENT_NBD_SERVER_H
+#define __EXTENT_NBD_SERVER_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define EXTENT_HOLE		(1 << 0)	// reads as zeroes, not allocated
+
+// extents per request, the rest of range is reported as data
+#define EXTENT_MAX		64
+
+typedef struct
+{
+	uint64_t	offset;
+	uint32_t	length;
+	uint32_t	flags;
+} EXTENT;
+
+
+/**
+ * split [offset, offset + length) to data and hole extents (SEEK_DATA/SEEK_HOLE)
+ * if file system can't tell, the whole range is data
+ * returns number of extents (at most max)
+**/
+int file_extents(int fd, uint64_t offset, uint32_t length, EXTENT* ext, int max);
+
+
+/*
+ * cache of export's layout : aligned regions with their extents
+ * (lives in export's shared state, writes invalidate regions they touch)
+*/
+#define EXTENT_REGION_SHIFT	22		// 4 MB regions
+#define EXTENT_REGION_MAX	16		// more fragmented regions aren't cached
+#define EXTENT_CACHE_SLOTS	1024
+
+typedef struct
+{
+	uint64_t	region;		// region index + 1 (0 - empty slot)
+	uint32_t	version;	// bumped by invalidation
+	uint32_t	n;
+	EXTENT		ext[EXTENT_REGION_MAX];
+} EXTENT_SLOT;
+
+typedef struct
+{
+	pthread_mutex_t	lock;
+	EXTENT_SLOT		slot[EXTENT_CACHE_SLOTS];
+} EXTENT_CACHE;
+
+
+/**
+ * init cache in memory shared between threads and processes
+**/
+void extent_cache_init(EXTENT_CACHE* c);
+
+void extent_cache_destroy(EXTENT_CACHE* c);
+
+/**
+ * file_extents() through the cache : file system is asked only
+ * about regions that are not cached yet
+**/
+int extent_cache_lookup(EXTENT_CACHE* c, int fd, uint64_t offset, uint32_t length, EXTENT* ext, int max);
+
+/**
+ * layout of [offset, offset + length) is changed (write, trim...)
+**/
+void extent_cache_invalidate(EXTENT_CACHE* c, uint64_t offset, uint64_t length);
+
+#endif
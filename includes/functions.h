@@ -1,6 +1,8 @@
 #ifndef __FUNCTION_NBD_SERVER_H
 #define __FUNCTION_NBD_SERVER_H
 
+#include <stdint.h>
+
 #define ERROR(...) fprintf(stderr, __VA_ARGS__)
 #define INFO(...)  fprintf(stdout, __VA_ARGS__)
 
@@ -24,21 +26,32 @@ unsigned long long ntohll(const unsigned long long input);
 unsigned long long htonll(const unsigned long long input);
 
 /* 
- *	return size of file (even if file is block device
+ *	return size of file (even if file is block device)
+ *	*blockdev (if not NULL) is set when file is block device
 */
-int get_file_size(int fd);
+int64_t get_file_size(int fd, uint16_t* blockdev);
 
 /**
- * send to client
+ * send to client (whole buffer, even if socket is non-blocking)
+ * returns 0 or -1 (error)
 **/
-void send_socket(int socket, void* data, int len);
+int send_socket(int socket, void* data, int len);
+
+
 
+/**
+ * send len bytes of file from offset to client with sendfile
+ * (zeroes after end of file)
+ * returns 0 or -1 (error)
+**/
+int sendfile_socket(int socket, int fd, uint64_t offset, uint32_t len);
 
 
 /**
- * get data from client
+ * get data from client (exactly len bytes)
+ * returns 0 or -1 (error or closed connection)
 **/
-void recv_socket(int socket, void* data, int len);
+int recv_socket(int socket, void* data, int len);
 
 #endif
 
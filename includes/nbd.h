@@ -50,12 +50,15 @@ typedef struct {
 #define NBD_OPT_LIST				3
 #define NBD_OPT_GO					7
 #define NBD_OPT_STRUCTURED_REPLY	8
+#define NBD_OPT_LIST_META_CONTEXT	9
+#define NBD_OPT_SET_META_CONTEXT	10
 
 // reply
 #define NBD_OPTION_REPLY_MAGIC		0x3e889045565a9
 #define NBD_REP_ACK 				1
 #define NBD_REP_SERVER 				2
 #define NBD_REP_INFO				3
+#define NBD_REP_META_CONTEXT		4
 // reply errors
 #define NBD_REP_ERR_UNSUP			(1 | (1 << 31))
 #define NBD_REP_ERR_INVALID			(3 | (1 << 31))
@@ -65,6 +68,10 @@ typedef struct {
 #define NBD_INFO_EXPORT				0
 #define NBD_INFO_NAME				1
 #define NBD_INFO_DESCRIPTION		2
+
+// metadata contexts (the only one is supported)
+#define NBD_META_BASE_ALLOCATION	"base:allocation"
+#define NBD_META_BASE_ALLOCATION_ID	1
 /*
  * structure described request of client to set 'option'
 */
@@ -119,15 +126,43 @@ typedef struct {
 
 #define NBD_FLAG_HAS_FLAGS  (1 << 0)
 #define NBD_FLAG_READ_ONLY 	(1 << 1)
+#define NBD_FLAG_SEND_FLUSH	(1 << 2)
+#define NBD_FLAG_SEND_FUA	(1 << 3)
+#define NBD_FLAG_SEND_TRIM	(1 << 5)
+#define NBD_FLAG_SEND_WRITE_ZEROES	(1 << 6)
+#define NBD_FLAG_CAN_MULTI_CONN	(1 << 8)
 
 // structured reply chunk
 #define NBD_REPLY_TYPE_NONE			0
 #define NBD_REPLY_TYPE_OFFSET_DATA	1
+#define NBD_REPLY_TYPE_OFFSET_HOLE	2
+#define NBD_REPLY_TYPE_BLOCK_STATUS	5
+#define NBD_REPLY_TYPE_ERROR		((1 << 15) + 1)
 #define NBD_REPLY_FLAG_DONE			(1 << 0)
 
 #define NBD_CMD_READ        0
 #define NBD_CMD_WRITE       1
 #define NBD_CMD_DISC        2
+#define NBD_CMD_FLUSH       3
+#define NBD_CMD_TRIM        4
+#define NBD_CMD_WRITE_ZEROES 6
+#define NBD_CMD_BLOCK_STATUS 7
+
+// command flags
+#define NBD_CMD_FLAG_FUA	(1 << 0)
+#define NBD_CMD_FLAG_NO_HOLE	(1 << 1)
+#define NBD_CMD_FLAG_REQ_ONE	(1 << 3)
+
+// base:allocation states
+#define NBD_STATE_HOLE		(1 << 0)
+#define NBD_STATE_ZERO		(1 << 1)
+
+// errors
+#define NBD_EPERM			1
+#define NBD_EIO				5
+#define NBD_ENOMEM			12
+#define NBD_EINVAL			22
+#define NBD_ENOSPC			28
 
 /*
  * transmition request (from client)
@@ -169,5 +204,30 @@ typedef struct {
 	unsigned int		length;
 } __attribute__((packed)) NBD_STRUCTURED_RESPONSE_HEADER;
 
+/*
+ * payload of NBD_REPLY_TYPE_OFFSET_HOLE chunk
+*/
+typedef struct {
+	unsigned long long	offset;
+	unsigned int		length;
+} __attribute__((packed)) NBD_STRUCTURED_HOLE;
+
+/*
+ * descriptor of NBD_REPLY_TYPE_BLOCK_STATUS chunk
+ * (payload is context id followed by descriptors)
+*/
+typedef struct {
+	unsigned int		length;
+	unsigned int		flags;
+} __attribute__((packed)) NBD_BLOCK_DESCRIPTOR;
+
+/*
+ * payload of NBD_REPLY_TYPE_ERROR chunk (message isn't sent)
+*/
+typedef struct {
+	unsigned int		error;
+	unsigned short		message_length;
+} __attribute__((packed)) NBD_STRUCTURED_ERROR;
+
 
 #endif
@@ -0,0 +1,89 @@
+/**
+ * server.h
+ * Server/client state and protocol handlers shared by the
+ * fork-per-connection loop and the epoll engine
+**/
+
+#ifndef __SERVER_NBD_SERVER_H
+#define __SERVER_NBD_SERVER_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "nbd.h"
+#include "args.h"
+
+/**
+ * Structures described server options
+**/
+typedef struct
+{
+	uint32_t 	port;
+	uint32_t 	socket;
+	uint32_t	quantity;
+	RESOURCE**	res;
+	uint16_t	zerocopy; // if READ replies are sent by sendfile
+	uint32_t	depth;    // max transmission requests in flight per client
+} NBD_SERVER;
+
+/**
+ * State of one client connection
+ * (everything that was per-process while each client had its own fork)
+**/
+typedef struct
+{
+	NBD_SERVER*	serv;
+	uint32_t	socket;
+	uint16_t	seq; // if sequence replies are setting
+	pthread_mutex_t	send_lock; // replies are sent one at a time
+	RESOURCE*	res; // export chosen by NBD_OPT_GO
+	uint32_t	meta; // context selected by NBD_OPT_SET_META_CONTEXT (0 - none)
+} NBD_CLIENT;
+
+/*
+ * structure contained result of option (i.e. chosen file descriptor or last set option)
+*/
+typedef struct
+{
+	RESOURCE* res;
+	int last_opt;
+} OPTION_RESULT;
+
+
+/* initial phase : S -> C */
+int handshake_server(uint32_t socket, uint32_t hs_flags);
+
+/*
+ *	type of handshake chosen by client's flags
+ *	returns:
+ *		1  -> newstyle negotiation
+ *		0  -> fixed newstyle negotiation : our decision
+ *		-1 -> unsupported flags
+*/
+int handshake_type(uint32_t clflags);
+
+/*
+ * convert option request header to host byteorder and validate it
+ * returns 0 if header is correct
+*/
+int option_request_decode(OPTION_REQUEST_HEADER* header);
+
+/*
+ * handling option requests (make a reply if it can), result is filled
+ * returns 0 or -1 (connection must be dropped)
+*/
+int handle_option(NBD_CLIENT* client, OPTION_REQUEST* op_req, OPTION_RESULT* result);
+
+/*
+ * convert transmission request header to host byteorder and validate it
+ * returns 0 if header is correct
+*/
+int nbd_request_decode(NBD_REQUEST_HEADER* header);
+
+/*
+ * handle all transmission commands (data - payload of NBD_CMD_WRITE)
+ * returns handled command or -1 (connection must be dropped)
+*/
+int handle_transmission(NBD_CLIENT* client, NBD_REQUEST_HEADER* header, void* data, uint32_t fd);
+
+#endif
@@ -16,20 +16,14 @@
 #include "includes/nbd.h"    // lib with useful NBD structures and constants
 #include "includes/args.h"   // work with shared resources and command line parsing
 #include "includes/functions.h"  // htonll, ntohll, ERROR, INFO, DEBUG
+#include "includes/server.h"     // server and client state, protocol handlers
+#include "includes/engine.h"     // epoll connection engine
+#include "includes/backend.h"    // storage backends (sync, io_uring)
+#include "includes/dispatch.h"   // pipelining of transmission requests
+#include "includes/export.h"     // state shared by connections of export
+#include "includes/extent.h"     // data/hole layout of export
+#include "includes/buffer.h"     // pooled request buffers
 
-/**
- * Structures described server options
-**/
-
-
-typedef struct 
-{
-	uint32_t 	port;
-	uint32_t 	socket;
-	uint32_t	quantity;
-	RESOURCE**	res;
-	uint16_t	seq; // if sequence replies are setting
-} NBD_SERVER;
 NBD_SERVER* nbd_server; // main server
 
 
@@ -80,9 +74,10 @@ init_server(uint32_t port)
 		free(s);
 		return NULL;
 	}
-	
-	// sequence reply flag
-	s->seq = 0;
+
+	// options of transmission
+	s->zerocopy = 0;
+	s->depth = 1;
 
 	// ctrl-c catch
 	struct sigaction act;
@@ -117,7 +112,7 @@ find_res_by_name(NBD_SERVER* serv, char* name)
 }
 
 /* initial phase : S -> C */
-void 
+int
 handshake_server(uint32_t socket, uint32_t hs_flags)
 {
 	HANDSHAKE_SERVER s_header = {
@@ -125,23 +120,20 @@ handshake_server(uint32_t socket, uint32_t hs_flags)
 		htonll(IHAVEOPT),
 		htons(hs_flags),
 	};
-	send_socket(socket, &s_header, sizeof(s_header));
+	return send_socket(socket, &s_header, sizeof(s_header));
 }
 
 /*
- *	function that return type of chosen handshake by client (get + valid) : C -> S
+ *	function that return type of handshake chosen by client's flags
  *	returns:
  *		1  -> newstyle negotiation		
  *		0  -> fixed newstyle negotiation : our decision
  *		-1 -> unsupported flags
 */
 int
-handshake_client(uint32_t socket)
+handshake_type(uint32_t clflags)
 {
-	HANDSHAKE_CLIENT c_header;
-	recv_socket(socket, &c_header, sizeof(c_header));
-
-	int flags = ntohl(c_header.clflags);
+	int flags = ntohl(clflags);
 	if (flags == NBD_FLAG_C_NO_ZEROES)
 	{
 		INFO("... Using newstyle negotiation ...\n");
@@ -157,88 +149,109 @@ handshake_client(uint32_t socket)
 }
 
 /*
- * handle option request
- * return : option code or -1 (error)
+ *	function that return type of chosen handshake by client (get + valid) : C -> S
 */
-OPTION_REQUEST*
-option_request(uint32_t socket) 
+int
+handshake_client(uint32_t socket)
+{
+	HANDSHAKE_CLIENT c_header;
+	if (recv_socket(socket, &c_header, sizeof(c_header)))
+		return -1;
+	return handshake_type(c_header.clflags);
+}
+
+/*
+ * convert option request header to host byteorder and validate it
+*/
+int
+option_request_decode(OPTION_REQUEST_HEADER* header)
 {
-	OPTION_REQUEST_HEADER* header = malloc(sizeof(OPTION_REQUEST_HEADER));
-	recv_socket(socket, header, sizeof(OPTION_REQUEST_HEADER));
 	header->magic 	= ntohll(header->magic);
 	header->option 	= ntohl(header->option);
 	header->len 	= ntohl(header->len);
 
-	OPTION_REQUEST* op_client = malloc(sizeof(OPTION_REQUEST));
-	op_client->header = header;
-	op_client->data = NULL;
-
 	// valid magic constant
 	if (header->magic != IHAVEOPT)
 	{
-		ERROR("invalid expectable magic constant in client's request option message");
-		exit(EXIT_FAILURE);
+		ERROR("invalid expectable magic constant in client's request option message\n");
+		return 1;
 	}
+	return 0;
+}
+
+/*
+ * receive option request into op_client (its header points to caller's storage,
+ * data is buffer_get() buffer or NULL)
+ * return : 0 or -1 (error)
+*/
+int
+option_request(uint32_t socket, OPTION_REQUEST* op_client) 
+{
+	OPTION_REQUEST_HEADER* header = op_client->header;
+	op_client->data = NULL;
+
+	if (recv_socket(socket, header, sizeof(OPTION_REQUEST_HEADER)) || option_request_decode(header))
+		return -1;
 	if (header->len != 0)
 	{
-		op_client->data = (char*) malloc(header->len);
+		op_client->data = (char*) buffer_get(header->len);
 		if (op_client->data == NULL)
 		{
-			ERROR("malloc error");
-			exit(EXIT_FAILURE);
+			ERROR("malloc error\n");
+			return -1;
+		}
+		if (recv_socket(socket, op_client->data, header->len))
+		{
+			buffer_put(op_client->data, header->len);
+			op_client->data = NULL;
+			return -1;
 		}
-		recv_socket(socket, op_client->data, header->len);
 	}
-	return op_client;
+	return 0;
 }
 
 /*
  * function that reply on setting option from client
 */
-void 
+int
 option_reply(uint32_t socket, uint32_t opt, uint32_t reply_type, int32_t datasize, void* data) 
 {
+	if (datasize < 0 && data != NULL)
+	{
+		datasize = strlen(data);
+	}
 	OPTION_REPLY_HEADER header = {
 		htonll(NBD_OPTION_REPLY_MAGIC),
 		htonl(opt),
 		htonl(reply_type),
 		htonl(datasize),
 	};
-	send_socket(socket, &header, sizeof(header));
-	if (datasize < 0 && data != NULL)
-	{
-		datasize = strlen(data);
-	}
+	if (send_socket(socket, &header, sizeof(header)))
+		return -1;
 	if(data != NULL) {
-		send_socket(socket, data, datasize);
+		return send_socket(socket, data, datasize);
 	}
+	return 0;
 }
 
-/*
- * structure contained result of option (i.e. chosen file descriptor or last set option)
-*/	
-typedef struct 
-{
-	RESOURCE* res;
-	int last_opt;
-} OPTION_RESULT;
-
 
 RESOURCE*
-option_go_handle(NBD_SERVER* serv, uint32_t socket, OPTION_REQUEST* req)
+option_go_handle(NBD_CLIENT* client, OPTION_REQUEST* req)
 {
+	NBD_SERVER* serv = client->serv;
+	uint32_t socket = client->socket;
 	OPTION_GO_DATA* ogd = (OPTION_GO_DATA*)req->data;
-	uint32_t len = ntohl(ogd->len);
 	uint32_t option = req->header->option;
 	char* export = NULL;
 	RESOURCE* res; // chosen export
 
-	if (len > req->header->len - 6)
+	if (req->header->len < 6 || ntohl(ogd->len) > req->header->len - 6)
 	{
 		option_reply(socket, option, NBD_REP_ERR_UNKNOWN, -1, "Incorrect length in option data field");
 		ERROR("Incorrect length in option data field\n");
-		exit(EXIT_FAILURE);
+		return NULL;
 	}
+	uint32_t len = ntohl(ogd->len);
 
 	if (len != 0)
 	{
@@ -246,18 +259,18 @@ option_go_handle(NBD_SERVER* serv, uint32_t socket, OPTION_REQUEST* req)
 		if (export == NULL)
 		{
 			ERROR("malloc failed\n");
-			exit(EXIT_FAILURE);
+			return NULL;
 		}
 		export[len] = '\0';
 		strncpy(export, (const char*) &ogd->name, len);
 		res = find_res_by_name(serv, export);
+		free(export);
 		if (res == NULL)
 		{
 			option_reply(socket, option, NBD_REP_ERR_UNKNOWN, -1, "Can't find requested resource");
 			ERROR("Can't find requested resource\n");
-			exit(EXIT_FAILURE);
+			return NULL;
 		}
-		free(export);
 	}
 	else
 	{
@@ -266,30 +279,42 @@ option_go_handle(NBD_SERVER* serv, uint32_t socket, OPTION_REQUEST* req)
 		{
 			option_reply(socket, option, NBD_REP_ERR_UNKNOWN, -1, "Can't find default resource");
 			ERROR("Can't find default resource\n");
-			exit(EXIT_FAILURE);
+			return NULL;
 		}		
 	}
-	// 0 (non-read only) : Sending EXPORT INFO (size + flags)
+	// Sending EXPORT INFO (size + flags)
+	// flushes are shared by all connections of export : multi-conn is safe
+	uint16_t flags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA
+		| NBD_FLAG_CAN_MULTI_CONN;
+	if (res->readonly)
+		flags |= NBD_FLAG_READ_ONLY;
+	else
+		flags |= NBD_FLAG_SEND_TRIM | NBD_FLAG_SEND_WRITE_ZEROES;
 	OPTION_GO_REP_INFO_EXPORT rie = {
 		htons(NBD_INFO_EXPORT),
 		htonll(res->size),
-		htons(NBD_FLAG_HAS_FLAGS)
+		htons(flags)
 	};
-	option_reply(socket, option, NBD_REP_INFO, sizeof(rie), &rie);
+	if (option_reply(socket, option, NBD_REP_INFO, sizeof(rie), &rie))
+		return NULL;
 	// start transmission
-	option_reply(socket, option, NBD_REP_ACK, 0, NULL);
+	if (option_reply(socket, option, NBD_REP_ACK, 0, NULL))
+		return NULL;
+	INFO("... Export %s : %u connections ...\n", res->exportname, export_attach(res->state));
 	return res;
 }
 
-void
-option_list_handle(NBD_SERVER* serv, uint32_t socket, OPTION_REQUEST* req)
+int
+option_list_handle(NBD_CLIENT* client, OPTION_REQUEST* req)
 {
+	NBD_SERVER* serv = client->serv;
+	uint32_t socket = client->socket;
 	uint32_t option = req->header->option;
 	if (req->header->len != 0)
 	{
 		option_reply(socket, option, NBD_REP_ERR_INVALID, -1, "Non-empty data field in NBD_OPT_LIST option");
-		ERROR("Non-empty data field in NBD_OPT_LIST option");
-		exit(EXIT_FAILURE);
+		ERROR("Non-empty data field in NBD_OPT_LIST option\n");
+		return -1;
 	}
 	RESOURCE** r = serv->res;
 	for (int i = 0; i < serv->quantity; i++)
@@ -297,38 +322,127 @@ option_list_handle(NBD_SERVER* serv, uint32_t socket, OPTION_REQUEST* req)
 		uint32_t servname_len = strlen(r[i]->exportname);
 		uint32_t nlen = htonl(servname_len);
 		char* buf = (char*) malloc(sizeof(nlen) + servname_len);
+		if (buf == NULL)
+		{
+			ERROR("malloc error\n");
+			return -1;
+		}
 		
 		memcpy(buf, &nlen, sizeof(nlen));
 		strncpy(buf + sizeof(nlen), r[i]->exportname, servname_len);
-		option_reply(socket, option, NBD_REP_SERVER, servname_len + sizeof(nlen), buf);	
+		int rc = option_reply(socket, option, NBD_REP_SERVER, servname_len + sizeof(nlen), buf);	
 		free(buf);
+		if (rc)
+			return -1;
 	}
-	option_reply(socket, option, NBD_REP_ACK, 0, NULL);
+	return option_reply(socket, option, NBD_REP_ACK, 0, NULL);
 }
 
-void
-option_structured_reply_handle(NBD_SERVER* serv, uint32_t socket, OPTION_REQUEST* req)
+int
+option_structured_reply_handle(NBD_CLIENT* client, OPTION_REQUEST* req)
 {
+	uint32_t socket = client->socket;
 	uint32_t option = req->header->option;
 	if (req->header->len != 0)
 	{
 		option_reply(socket, option, NBD_REP_ERR_INVALID, -1, "Non-empty data field in NBD_STRUCTURED_REPLY option");
-		ERROR("Non-empty data field in NBD_STRUCTURED_REPLY option");
-		exit(EXIT_FAILURE);
+		ERROR("Non-empty data field in NBD_STRUCTURED_REPLY option\n");
+		return -1;
 	}
-	serv->seq = 1;
-	option_reply(socket, option, NBD_REP_ACK, 0, NULL);
+	client->seq = 1;
+	return option_reply(socket, option, NBD_REP_ACK, 0, NULL);
+}
+
+/*
+ * NBD_OPT_LIST_META_CONTEXT / NBD_OPT_SET_META_CONTEXT
+ * data : export name (u32 length + name), queries (u32 number, u32 length + query each)
+ * the only context is base:allocation (data/hole layout of export)
+*/
+int
+option_meta_context_handle(NBD_CLIENT* client, OPTION_REQUEST* req)
+{
+	uint32_t socket = client->socket;
+	uint32_t option = req->header->option;
+	uint32_t len = req->header->len;
+	char* data = req->data;
+	uint32_t pos, n;
+
+	if (option == NBD_OPT_SET_META_CONTEXT)
+		client->meta = 0;
+	if (!client->seq)
+		return option_reply(socket, option, NBD_REP_ERR_INVALID, -1, "Structured replies are not negotiated");
+
+	// export name
+	if (len < sizeof(n))
+		return option_reply(socket, option, NBD_REP_ERR_INVALID, -1, "Incorrect length in option data field");
+	memcpy(&n, data, sizeof(n));
+	n = ntohl(n);
+	if (n > len - sizeof(n) || len - sizeof(n) - n < sizeof(n))
+		return option_reply(socket, option, NBD_REP_ERR_INVALID, -1, "Incorrect length in option data field");
+	char* export = (char*) malloc(n + 1);
+	if (export == NULL)
+	{
+		ERROR("malloc error\n");
+		return -1;
+	}
+	memcpy(export, data + sizeof(n), n);
+	export[n] = '\0';
+	RESOURCE* res = find_res_by_name(client->serv, n ? export : "default");
+	free(export);
+	if (res == NULL)
+		return option_reply(socket, option, NBD_REP_ERR_UNKNOWN, -1, "Can't find requested resource");
+	pos = sizeof(n) + n;
+
+	// queries
+	uint32_t queries;
+	memcpy(&queries, data + pos, sizeof(queries));
+	queries = ntohl(queries);
+	pos += sizeof(queries);
+	int selected = option == NBD_OPT_LIST_META_CONTEXT && queries == 0;
+	for (uint32_t i = 0; i < queries; i++)
+	{
+		if (len - pos < sizeof(n))
+			return option_reply(socket, option, NBD_REP_ERR_INVALID, -1, "Incorrect length in option data field");
+		memcpy(&n, data + pos, sizeof(n));
+		n = ntohl(n);
+		pos += sizeof(n);
+		if (n > len - pos)
+			return option_reply(socket, option, NBD_REP_ERR_INVALID, -1, "Incorrect length in option data field");
+		const char* ctx = NBD_META_BASE_ALLOCATION;
+		if (n == strlen(ctx) && !memcmp(data + pos, ctx, n))
+			selected = 1;
+		// listing : "base:" means all contexts of namespace
+		if (option == NBD_OPT_LIST_META_CONTEXT && n == 5 && !memcmp(data + pos, ctx, n))
+			selected = 1;
+		pos += n;
+	}
+
+	if (selected)
+	{
+		struct {
+			uint32_t	id;
+			char		name[sizeof(NBD_META_BASE_ALLOCATION) - 1];
+		} __attribute__((packed)) ctx = {
+			htonl(NBD_META_BASE_ALLOCATION_ID),
+		};
+		memcpy(ctx.name, NBD_META_BASE_ALLOCATION, sizeof(ctx.name));
+		if (option_reply(socket, option, NBD_REP_META_CONTEXT, sizeof(ctx), &ctx))
+			return -1;
+		if (option == NBD_OPT_SET_META_CONTEXT)
+			client->meta = NBD_META_BASE_ALLOCATION_ID;
+	}
+	return option_reply(socket, option, NBD_REP_ACK, 0, NULL);
 }
 
 /*
  * handling option requests (make a reply if it can)
+ * returns -1 when connection must be dropped
 */
-OPTION_RESULT*
-handle_option(NBD_SERVER* serv, uint32_t socket, OPTION_REQUEST* op_req)
+int
+handle_option(NBD_CLIENT* client, OPTION_REQUEST* op_req, OPTION_RESULT* result)
 {
 	uint32_t option = op_req->header->option;
 
-	OPTION_RESULT* result = (OPTION_RESULT*) malloc(sizeof(OPTION_RESULT));
 	result->last_opt = option;
 	result->res = NULL;	
 	switch (option) 
@@ -336,43 +450,61 @@ handle_option(NBD_SERVER* serv, uint32_t socket, OPTION_REQUEST* op_req)
 		case NBD_OPT_GO:
 		{
 			INFO(">>>> option : GO\n\n");
-			result->res = option_go_handle(serv, socket, op_req);
-			return result;
+			result->res = option_go_handle(client, op_req);
+			if (result->res == NULL)
+				break;
+			return 0;
 		}
 		case NBD_OPT_LIST:	
 		{
 			INFO(">>>> option : LIST\n");
-			option_list_handle(serv, socket, op_req);
-			return result;
+			if (option_list_handle(client, op_req))
+				break;
+			return 0;
 		}
 		case NBD_OPT_ABORT:
 		{
 			INFO(">>>> option : ABORT\n");
-			return result;
+			return 0;
 		}	
 		case NBD_OPT_STRUCTURED_REPLY:
 		{
-			option_structured_reply_handle(serv, socket, op_req);
+			if (option_structured_reply_handle(client, op_req))
+				break;
 			INFO(">>>> option : STRUCTURED REPLY\n");
-			return result;
+			return 0;
 		}	
+		case NBD_OPT_LIST_META_CONTEXT:
+		case NBD_OPT_SET_META_CONTEXT:
+		{
+			INFO(">>>> option : %s META CONTEXT\n", option == NBD_OPT_SET_META_CONTEXT ? "SET" : "LIST");
+			if (option_meta_context_handle(client, op_req))
+				break;
+			return 0;
+		}
 		default:
 		{
 			ERROR(">>>> unknown option\n");
-			return result;
+			// client may go on with other options
+			if (option_reply(client->socket, option, NBD_REP_ERR_UNSUP, -1, "Unsupported option"))
+				break;
+			return 0;
 		}
 	}
+	return -1;
 }
 
 /*
  * main function to handle handshake phase (initial handshake + set options)
 */
 RESOURCE*
-handshake(NBD_SERVER* serv, uint32_t socket, uint16_t hs_flags)
+handshake(NBD_CLIENT* client, uint16_t hs_flags)
 {
+	uint32_t socket = client->socket;
 	INFO("\n<<< Handshake phase >>>\n\n");
-	handshake_server(socket, hs_flags);
-	OPTION_RESULT* result = NULL;
+	if (handshake_server(socket, hs_flags))
+		return NULL;
+	OPTION_RESULT result;
 	int hs_type = handshake_client(socket);
 
 	// choose type of handshake in execution flow
@@ -384,40 +516,39 @@ handshake(NBD_SERVER* serv, uint32_t socket, uint16_t hs_flags)
 		case 0:	
 			/* phase of setting options */
 			INFO("\n<<< Option phase >>>\n\n");
-			OPTION_REQUEST* op_client;
-			OPTION_REQUEST_HEADER* oc_header;
+			OPTION_REQUEST_HEADER oc_header;
+			OPTION_REQUEST op_client = {
+				&oc_header,
+				NULL,
+			};
 
 			do
 			{
-				if (result != NULL) 
-					free(result); 
-				op_client = option_request(socket);
-				oc_header = op_client->header;
+				if (option_request(socket, &op_client))
+					return NULL;
 				fprintf(stderr, "------ [ REQUEST ] ------\n");	
-				fprintf(stderr, "	magic %llx\n", oc_header->magic);
-				fprintf(stderr, "	opt %x\n", oc_header->option);
-				fprintf(stderr, "	len %d\n", oc_header->len);
+				fprintf(stderr, "	magic %llx\n", oc_header.magic);
+				fprintf(stderr, "	opt %x\n", oc_header.option);
+				fprintf(stderr, "	len %d\n", oc_header.len);
 				fprintf(stderr, "-------------------------\n");	
 				
-				result = handle_option(serv, socket, op_client);
-				// free dynamic allocated memory
-				free(op_client->data);
-				free(op_client->header);
-				free(op_client);
-			} while (result->last_opt != NBD_OPT_GO && result->last_opt != NBD_OPT_ABORT);
+				int rc = handle_option(client, &op_client, &result);
+				buffer_put(op_client.data, oc_header.len);
+				if (rc)
+					return NULL;
+			} while (result.last_opt != NBD_OPT_GO && result.last_opt != NBD_OPT_ABORT);
 			
-			if (result->last_opt == NBD_OPT_ABORT) 
+			if (result.last_opt == NBD_OPT_ABORT) 
 			{
 				INFO("abord (handshake)\n");
 				return NULL;
 			}
-			RESOURCE* return_res = result->res;
-			free(result);
-			return return_res;
+			return result.res;
 		case 1:
 			ERROR("initial phase of handshake client unsupported\n");
 			return NULL;
 	}
+	return NULL;
 }
 
 /* 
@@ -433,31 +564,68 @@ valid_nbd_request_header(NBD_REQUEST_HEADER* header)
 	return 0;
 }
 
+/*
+ * convert transmission request header to host byteorder and validate it
+*/
+int
+nbd_request_decode(NBD_REQUEST_HEADER* header)
+{
+	header->magic = ntohl(header->magic);
+	header->flags = ntohs(header->flags);
+	header->type = ntohs(header->type);
+	header->handle = ntohll(header->handle);
+	header->offset = ntohll(header->offset);
+	header->length = ntohl(header->length);
+
+	// MUST VALID HEADER
+	if (valid_nbd_request_header(header))
+	{
+		ERROR("Non-valid request header (transmission mode)\n");
+		return 1;
+	}
+	fprintf(stderr, "---  [ TRANSMISSION REQUEST ] ---\n");	
+	fprintf(stderr, "	magic %x\n", header->magic);
+	fprintf(stderr, "	flags %x\n", header->flags);
+	fprintf(stderr, "	type %d\n", header->type);
+	fprintf(stderr, "	handle %llx\n", header->handle);
+	fprintf(stderr, "	offset %lld\n", header->offset);
+	fprintf(stderr, "	length %d\n", header->length);
+	fprintf(stderr, "-------------------------------\n");	
+	return 0;
+}
+
 /* 
  * create an reply to request (simple reply)
+ * replies of one client are sent one at a time (requests may be handled concurrently)
 */
-void 
+int
 transmission_reply
-(uint32_t socket, uint32_t error, uint64_t handle, uint32_t datasize, void* data) 
+(NBD_CLIENT* client, uint32_t error, uint64_t handle, uint32_t datasize, void* data) 
 {
 	NBD_RESPONSE_HEADER header = {
 		htonl(NBD_SIMPLE_REPLY_MAGIC),
 		htonl(error),
 		htonll(handle),
 	};
-	send_socket(socket, &header, sizeof(header));
-	if(data != NULL) {
-		send_socket(socket, data, datasize);
+	int rc = 0;
+	pthread_mutex_lock(&client->send_lock);
+	if (send_socket(client->socket, &header, sizeof(header)))
+		rc = -1;
+	else if(data != NULL) {
+		rc = send_socket(client->socket, data, datasize);
 	}
-	fprintf(stderr, "--->>> Send - %d bytes <<< ---\n\n", datasize);
+	pthread_mutex_unlock(&client->send_lock);
+	if (rc == 0)
+		fprintf(stderr, "--->>> Send - %d bytes <<< ---\n\n", datasize);
+	return rc;
 }
 
 /* 
  * create an reply to request (structured chunked reply)
 */
-void 
+int
 transmission_structured_reply
-(uint32_t socket, uint16_t flags, uint16_t type, uint64_t handle, uint32_t datasize, void* data) 
+(NBD_CLIENT* client, uint16_t flags, uint16_t type, uint64_t handle, uint32_t datasize, void* data) 
 {
 	NBD_STRUCTURED_RESPONSE_HEADER header = {
 		htonl(NBD_STRUCTURED_REPLY_MAGIC),
@@ -466,68 +634,337 @@ transmission_structured_reply
 		htonll(handle),
 		htonl(datasize),	
 	};
-	send_socket(socket, &header, sizeof(header));
-	if(data != NULL) {
-		send_socket(socket, data, datasize);
+	int rc = 0;
+	pthread_mutex_lock(&client->send_lock);
+	if (send_socket(client->socket, &header, sizeof(header)))
+		rc = -1;
+	else if(data != NULL) {
+		rc = send_socket(client->socket, data, datasize);
 	}
-	fprintf(stderr, "--->>> Send Structured reply - %d bytes <<< ---\n\n", datasize);
+	pthread_mutex_unlock(&client->send_lock);
+	if (rc == 0)
+		fprintf(stderr, "--->>> Send Structured reply - %d bytes <<< ---\n\n", datasize);
+	return rc;
+}
+
+/*
+ * reply with error to request (simple reply or NBD_REPLY_TYPE_ERROR chunk)
+*/
+int
+transmission_error(NBD_CLIENT* client, uint64_t handle, uint32_t error)
+{
+	if (client->seq)
+	{
+		NBD_STRUCTURED_ERROR err = {
+			htonl(error),
+			htons(0),
+		};
+		return transmission_structured_reply(client, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_ERROR,
+				handle, sizeof(err), &err);
+	}
+	return transmission_reply(client, error, handle, 0, NULL);
+}
+
+/*
+ * reply without payload to successful request
+*/
+int
+transmission_ack(NBD_CLIENT* client, uint64_t handle)
+{
+	if (client->seq)
+	{
+		return transmission_structured_reply(client, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_NONE,
+				handle, 0, NULL);
+	}
+	return transmission_reply(client, 0, handle, 0, NULL);
+}
+
+/*
+ * payload of chunk/reply : len bytes of file from offset
+ * (zero-copy : sendfile, otherwise read to buffer)
+ * must be called under send lock after header
+*/
+int
+transmission_payload(NBD_CLIENT* client, uint64_t offset, uint32_t len, uint32_t fd, void* data)
+{
+	if (data == NULL)
+		return sendfile_socket(client->socket, fd, offset, len);
+	return send_socket(client->socket, data, len);
+}
+
+/*
+ * read len bytes of file for the reply (nothing in zero-copy mode)
+ * returns 0 or -1 (read error), *data is buffer to free
+*/
+int
+transmission_read_data(NBD_CLIENT* client, uint64_t offset, uint32_t len, uint32_t fd, char** data)
+{
+	*data = NULL;
+	if (client->serv->zerocopy)
+		return 0;
+	*data = (char*) buffer_get(len);
+	if (*data == NULL)
+	{
+		ERROR("malloc error\n");
+		return -1;
+	}
+	ssize_t cnt = backend_read(fd, *data, len, offset);
+	if (cnt == -1)
+	{
+		buffer_put(*data, len);
+		*data = NULL;
+		ERROR("read file error\n");
+		return -1;
+	}
+	// after end of file
+	memset(*data + cnt, 0, len - cnt);
+	return 0;
+}
+
+/*
+ * NBD_CMD_READ, simple reply : header + data
+*/
+int
+transmission_read_simple(NBD_CLIENT* client, NBD_REQUEST_HEADER* header, uint32_t fd)
+{
+	char* data;
+	if (transmission_read_data(client, header->offset, header->length, fd, &data))
+		return transmission_error(client, header->handle, NBD_EIO) ? -1 : NBD_CMD_READ;
+
+	NBD_RESPONSE_HEADER reply = {
+		htonl(NBD_SIMPLE_REPLY_MAGIC),
+		htonl(0),
+		htonll(header->handle),
+	};
+	pthread_mutex_lock(&client->send_lock);
+	int rc = send_socket(client->socket, &reply, sizeof(reply));
+	if (rc == 0)
+		rc = transmission_payload(client, header->offset, header->length, fd, data);
+	pthread_mutex_unlock(&client->send_lock);
+	buffer_put(data, header->length);
+	if (rc == 0)
+		fprintf(stderr, "--->>> Send - %d bytes <<< ---\n\n", header->length);
+	return rc ? -1 : NBD_CMD_READ;
+}
+
+/*
+ * NBD_REPLY_TYPE_OFFSET_DATA chunk
+*/
+int
+transmission_data_chunk(NBD_CLIENT* client, uint16_t flags, uint64_t handle, EXTENT* ext, uint32_t fd)
+{
+	char* data;
+	if (transmission_read_data(client, ext->offset, ext->length, fd, &data))
+		return 1;
+
+	struct {
+		NBD_STRUCTURED_RESPONSE_HEADER	header;
+		uint64_t						offset;
+	} __attribute__((packed)) chunk = {
+		{
+			htonl(NBD_STRUCTURED_REPLY_MAGIC),
+			htons(flags),
+			htons(NBD_REPLY_TYPE_OFFSET_DATA),
+			htonll(handle),
+			htonl(ext->length + sizeof(uint64_t)),
+		},
+		htonll(ext->offset),
+	};
+	pthread_mutex_lock(&client->send_lock);
+	int rc = send_socket(client->socket, &chunk, sizeof(chunk));
+	if (rc == 0)
+		rc = transmission_payload(client, ext->offset, ext->length, fd, data);
+	pthread_mutex_unlock(&client->send_lock);
+	buffer_put(data, ext->length);
+	if (rc == 0)
+		fprintf(stderr, "--->>> Send Structured reply - %d bytes <<< ---\n\n", ext->length);
+	return rc;
+}
+
+/*
+ * NBD_REPLY_TYPE_OFFSET_HOLE chunk : zeroes are neither read nor sent
+*/
+int
+transmission_hole_chunk(NBD_CLIENT* client, uint16_t flags, uint64_t handle, EXTENT* ext)
+{
+	NBD_STRUCTURED_HOLE hole = {
+		htonll(ext->offset),
+		htonl(ext->length),
+	};
+	return transmission_structured_reply(client, flags, NBD_REPLY_TYPE_OFFSET_HOLE, handle, sizeof(hole), &hole);
+}
+
+/*
+ * NBD_CMD_READ, structured reply : region is split along data and holes,
+ * one chunk per extent
+*/
+int
+transmission_read_structured(NBD_CLIENT* client, NBD_REQUEST_HEADER* header, uint32_t fd)
+{
+	EXTENT ext[EXTENT_MAX];
+	int n = extent_cache_lookup(&client->res->state->extents, fd, header->offset, header->length,
+			ext, EXTENT_MAX);
+	for (int i = 0; i < n; i++)
+	{
+		uint16_t flags = i == n - 1 ? NBD_REPLY_FLAG_DONE : 0;
+		int rc = ext[i].flags & EXTENT_HOLE
+			? transmission_hole_chunk(client, flags, header->handle, &ext[i])
+			: transmission_data_chunk(client, flags, header->handle, &ext[i], fd);
+		if (rc == 1)
+			return transmission_error(client, header->handle, NBD_EIO) ? -1 : NBD_CMD_READ;
+		if (rc)
+			return -1;
+	}
+	return NBD_CMD_READ;
+}
+
+/*
+ * NBD_CMD_READ
+*/
+int
+transmission_read(NBD_CLIENT* client, NBD_REQUEST_HEADER* header, uint32_t fd)
+{
+	if (client->seq && header->length > 0)
+		return transmission_read_structured(client, header, fd);
+	return transmission_read_simple(client, header, fd);
+}
+
+/*
+ * NBD_CMD_WRITE : data goes to export (durable before reply if FUA is set)
+*/
+int
+transmission_write(NBD_CLIENT* client, NBD_REQUEST_HEADER* header, void* data, uint32_t fd)
+{
+	RESOURCE* res = client->res;
+	uint32_t error = 0;
+	if (res->readonly)
+		error = NBD_EPERM;
+	else if (header->offset + header->length > res->size)
+		error = NBD_ENOSPC;
+	else if (backend_write(fd, data, header->length, header->offset) != header->length)
+		error = NBD_EIO;
+	else
+	{
+		// written holes become data
+		extent_cache_invalidate(&res->state->extents, header->offset, header->length);
+		group_commit_write(&res->state->commit);
+		if ((header->flags & NBD_CMD_FLAG_FUA) && group_commit_sync(&res->state->commit, fd))
+			error = NBD_EIO;
+	}
+
+	int rc = error ? transmission_error(client, header->handle, error) 
+		: transmission_ack(client, header->handle);
+	return rc ? -1 : NBD_CMD_WRITE;
+}
+
+/*
+ * NBD_CMD_TRIM / NBD_CMD_WRITE_ZEROES : region is discarded or zeroed
+ * by file system or device, no payload goes through the socket
+*/
+int
+transmission_discard(NBD_CLIENT* client, NBD_REQUEST_HEADER* header, uint32_t fd)
+{
+	RESOURCE* res = client->res;
+	uint32_t error = 0;
+	int rc;
+	if (res->readonly)
+		error = NBD_EPERM;
+	else if (header->offset + header->length > res->size)
+		error = header->type == NBD_CMD_TRIM ? NBD_EINVAL : NBD_ENOSPC;
+	else
+	{
+		if (header->type == NBD_CMD_TRIM)
+			rc = backend_discard(fd, res->blockdev, header->offset, header->length);
+		else
+			rc = backend_zero(fd, res->blockdev, header->offset, header->length,
+					header->flags & NBD_CMD_FLAG_NO_HOLE);
+		// layout is changed even if the call failed halfway
+		extent_cache_invalidate(&res->state->extents, header->offset, header->length);
+		if (rc)
+			error = NBD_EIO;
+		else
+		{
+			group_commit_write(&res->state->commit);
+			if ((header->flags & NBD_CMD_FLAG_FUA) && group_commit_sync(&res->state->commit, fd))
+				error = NBD_EIO;
+		}
+	}
+
+	rc = error ? transmission_error(client, header->handle, error)
+		: transmission_ack(client, header->handle);
+	return rc ? -1 : header->type;
+}
+
+/*
+ * NBD_CMD_FLUSH : everything completed before is made durable
+ * (one fdatasync for all concurrent flushes of the export)
+*/
+int
+transmission_flush(NBD_CLIENT* client, NBD_REQUEST_HEADER* header, uint32_t fd)
+{
+	int rc = group_commit_sync(&client->res->state->commit, fd) 
+		? transmission_error(client, header->handle, NBD_EIO)
+		: transmission_ack(client, header->handle);
+	return rc ? -1 : NBD_CMD_FLUSH;
+}
+
+/*
+ * NBD_CMD_BLOCK_STATUS : base:allocation descriptors of requested region
+ * (one descriptor if NBD_CMD_FLAG_REQ_ONE is set)
+*/
+int
+transmission_block_status(NBD_CLIENT* client, NBD_REQUEST_HEADER* header, uint32_t fd)
+{
+	RESOURCE* res = client->res;
+	if (client->meta != NBD_META_BASE_ALLOCATION_ID || header->length == 0
+		|| header->offset + header->length > res->size)
+	{
+		return transmission_error(client, header->handle, NBD_EINVAL) ? -1 : NBD_CMD_BLOCK_STATUS;
+	}
+
+	EXTENT ext[EXTENT_MAX];
+	int n = extent_cache_lookup(&res->state->extents, fd, header->offset, header->length, ext, EXTENT_MAX);
+	if (header->flags & NBD_CMD_FLAG_REQ_ONE)
+		n = 1;
+
+	struct {
+		uint32_t				id;
+		NBD_BLOCK_DESCRIPTOR	desc[EXTENT_MAX];
+	} __attribute__((packed)) status;
+	status.id = htonl(client->meta);
+	for (int i = 0; i < n; i++)
+	{
+		status.desc[i].length = htonl(ext[i].length);
+		status.desc[i].flags = htonl(ext[i].flags & EXTENT_HOLE ? NBD_STATE_HOLE | NBD_STATE_ZERO : 0);
+	}
+	int rc = transmission_structured_reply(client, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_BLOCK_STATUS,
+			header->handle, sizeof(uint32_t) + n * sizeof(NBD_BLOCK_DESCRIPTOR), &status);
+	return rc ? -1 : NBD_CMD_BLOCK_STATUS;
 }
 
 /*
  * handle all transmission commands
 */
 int
-handle_transmission(NBD_SERVER* serv, uint32_t socket, NBD_REQUEST_HEADER* header, uint32_t fd)
+handle_transmission(NBD_CLIENT* client, NBD_REQUEST_HEADER* header, void* data, uint32_t fd)
 {
 	switch(header->type)
 	{
 		case NBD_CMD_READ:
-			if (lseek(fd, header->offset, SEEK_SET) == -1)
-			{
-				ERROR("Error to read from file\n");
-				exit(EXIT_FAILURE);
-
-			}
-			int data_offset = serv->seq ? sizeof(header->offset) : 0; // DRY
-			char* data = (char*) malloc(header->length + data_offset);
-			if (data == NULL)
-			{
-				ERROR("malloc error\n");
-				exit(EXIT_FAILURE);
-			}
-			if (read(fd, data + data_offset, header->length) == -1)
-			{
-				free(data);
-				ERROR("read file error\n");
-				exit(EXIT_FAILURE);
-			}
-			if (serv->seq)
-			{
-				// this handling of transmission could be optimizated by support addtion types
-				uint64_t n_offset = htonll(header->offset);
-				memcpy(data, &n_offset, sizeof(header->offset));
-				transmission_structured_reply(socket, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_OFFSET_DATA, 
-						header->handle, header->length + data_offset, data);
-			}
-			else	
-			{
-				transmission_reply(socket, 0, header->handle, header->length, data);
-			}
-			free(data);
-			return NBD_CMD_READ;
+			return transmission_read(client, header, fd);
 
 		case NBD_CMD_WRITE:
-			/* SUPPORT STRUCTURED REPLY */
-			if (serv->seq)
-			{
-				transmission_structured_reply(socket, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_NONE, 
-						header->handle, 0, NULL);
-			}
-			else	
-			{
-				transmission_reply(socket, 0, header->handle, 0, NULL);
-			}
-			return NBD_CMD_READ;
+			return transmission_write(client, header, data, fd);
+
+		case NBD_CMD_FLUSH:
+			return transmission_flush(client, header, fd);
+
+		case NBD_CMD_TRIM:
+		case NBD_CMD_WRITE_ZEROES:
+			return transmission_discard(client, header, fd);
+
+		case NBD_CMD_BLOCK_STATUS:
+			return transmission_block_status(client, header, fd);
 
 		case NBD_CMD_DISC:
 			return NBD_CMD_DISC;
@@ -542,8 +979,9 @@ handle_transmission(NBD_SERVER* serv, uint32_t socket, NBD_REQUEST_HEADER* heade
  * transmission phase
 */
 int
-transmission(NBD_SERVER* serv, uint32_t socket, uint32_t fd)
+transmission(NBD_CLIENT* client, uint32_t fd)
 {
+	uint32_t socket = client->socket;
 	INFO("\n<<< Transmission phase >>>\n\n");
 	NBD_REQUEST_HEADER header;
 	NBD_REQUEST req = {
@@ -551,52 +989,51 @@ transmission(NBD_SERVER* serv, uint32_t socket, uint32_t fd)
 		NULL,
 	};
 
-	int	last_cmd; // contains value of last handled command
-	do 
-	{
-
-		recv_socket(socket, &header, sizeof(NBD_REQUEST_HEADER));
-		header.magic = ntohl(header.magic);
-		header.flags = ntohs(header.flags);
-		header.type = ntohs(header.type);
-		header.handle = ntohll(header.handle);
-		header.offset = ntohll(header.offset);
-		header.length = ntohl(header.length);
+	// requests are executed by dispatcher (concurrently if queue depth > 1)
+	DISPATCHER d;
+	dispatcher_init(&d, client, fd, client->serv->depth);
 
-		// MUST VALID HEADER
-		if (valid_nbd_request_header(&header))
+	int	rc = 0;
+	while (rc != -1) 
+	{
+		if (recv_socket(socket, &header, sizeof(NBD_REQUEST_HEADER)) || nbd_request_decode(&header))
 		{
-			ERROR("Non-valid request header (transmission mode)\n");
-			exit(EXIT_FAILURE);
+			rc = -1;
+			break;
 		}
-		fprintf(stderr, "---  [ TRANSMISSION REQUEST ] ---\n");	
-		fprintf(stderr, "	magic %x\n", header.magic);
-		fprintf(stderr, "	flags %x\n", header.flags);
-		fprintf(stderr, "	type %d\n", header.type);
-		fprintf(stderr, "	handle %llx\n", header.handle);
-		fprintf(stderr, "	offset %lld\n", header.offset);
-		fprintf(stderr, "	length %d\n", header.length);
-		fprintf(stderr, "-------------------------------\n");	
+		if (header.type == NBD_CMD_DISC)
+			break;
 		// when we get cmd to write we must recieve all data from socket
+		void* data = NULL;
 		if(header.type == NBD_CMD_WRITE)
 		{
-			void* data = malloc(header.length);
+			data = buffer_get(header.length);
 			if (data == NULL)
 			{
 				ERROR("malloc error\n");
-				exit(EXIT_FAILURE);
+				rc = -1;
+				break;
+			}
+			if (recv_socket(socket, data, header.length))
+			{
+				buffer_put(data, header.length);
+				rc = -1;
+				break;
 			}
-			recv_socket(socket, data, header.length);
-			free(data);
 		}
 		
 		// handle each request
-		last_cmd = handle_transmission(serv, socket, &header, fd);	
+		rc = dispatch_submit(&d, &header, data);
+		if (rc == 1)
+			rc = dispatch_wait(&d);
 	}
-	while (last_cmd != NBD_CMD_DISC && last_cmd != -1);
-	if (last_cmd == -1)
+	// requests in flight are completed before disconnect
+	if (dispatch_drain(&d))
+		rc = -1;
+	dispatcher_destroy(&d);
+	if (rc == -1)
 	{
-		ERROR("Unsupported commands, exit\n");
+		ERROR("Transmission failed, exit\n");
 		return -1;	
 	}
 	return 0;
@@ -616,9 +1053,36 @@ main(int argc, char* argv[])
 	if (!nbd_server) 		return 0;
 
 	nbd_server->quantity = cmd_args->n;
+	nbd_server->zerocopy = cmd_args->zerocopy;
+	nbd_server->depth = cmd_args->depth;
 
 	nbd_server->res = parse_devices_line(cmd_args);
 
+	// storage backend
+	int backend = backend_select(cmd_args->backend);
+	if (backend == -1)
+	{
+		ERROR("unknown backend %s\n", cmd_args->backend);
+		free(nbd_server);
+		free(cmd_args);
+		return 0;
+	}
+	if (backend == BACKEND_URING_REG)
+	{
+		int fds[nbd_server->quantity];
+		for (int i = 0; i < nbd_server->quantity; i++)
+			fds[i] = nbd_server->res[i]->fd;
+		backend_register_files(fds, nbd_server->quantity);
+	}
+	// request buffers (registered as fixed buffers for uring-reg)
+	if (buffer_pool_init((size_t) cmd_args->pool << 20))
+	{
+		ERROR("buffer pool error\n");
+		free(nbd_server);
+		free(cmd_args);
+		return 0;
+	}
+
 	// listening socket
 	if (listen(nbd_server->socket, 10))
 	{
@@ -627,14 +1091,21 @@ main(int argc, char* argv[])
 		free(cmd_args);
 		return 0;
 	}
+	uint32_t workers = cmd_args->workers;
 	free(cmd_args);	
+
+	// event-driven mode : fixed pool of epoll workers instead of fork per client
+	if (workers > 0)
+	{
+		return engine_run(nbd_server, workers);
+	}
 	
 	RESOURCE* resource = NULL;
 	// main loop
 	while(1)
 	{
 		int connect_fd = accept(nbd_server->socket, (struct sockaddr*) NULL, NULL);
-		if (!connect_fd) 
+		if (connect_fd == -1) 
 		{
 			ERROR("accept lcall error\n");
 			close(nbd_server->socket);
@@ -650,16 +1121,27 @@ main(int argc, char* argv[])
 		if (pid == 0) 
 		{
 			close(nbd_server->socket);
-			resource = handshake(nbd_server, connect_fd, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+			NBD_CLIENT client = {
+				nbd_server,
+				connect_fd,
+				0,
+				PTHREAD_MUTEX_INITIALIZER,
+				NULL,
+				0,
+			};
+			resource = handshake(&client, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
 			if (resource == NULL)
 			{
 				ERROR("... Handshake is not established ...\n");
 				free(nbd_server);
 				exit(EXIT_FAILURE);
 			}
+			client.res = resource;
 			INFO("[PID = %d]... Handshake is established ....\n", getpid());
 
-			if (transmission(nbd_server, connect_fd, resource->fd))
+			int rc = transmission(&client, resource->fd);
+			export_detach(resource->state);
+			if (rc)
 			{
 				ERROR("...Transmission error...\n");	
 				free(nbd_server);
@@ -672,6 +1154,6 @@ main(int argc, char* argv[])
 			free(nbd_server);
 			return 0;	
 		}
+		close(connect_fd);
 	}
 }
-